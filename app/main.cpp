@@ -9,7 +9,7 @@
 
 #include "nfd.h"
 
-#include "quiltis.hpp"
+#include "quiltis_sfml.hpp"
 
 int main()
 {
@@ -32,7 +32,11 @@ int main()
 
     sf::Texture resultTexture;
 
+    // Settings that only change how the blocks are drawn redraw the last plan instead of picking the blocks again
+    std::optional<Quiltis::QuiltPlan> quiltPlan;
+
     bool isDirty = true;
+    bool isRenderDirty = false;
 
     sf::Clock clock;
     while (window.isOpen())
@@ -119,7 +123,7 @@ int main()
                     showVec("Quilt Size", settings.quiltSize, 0.2f, 2, 10);
 
                     int selectionIndex = settings.blockSelection.index();
-                    const auto items = "Random\0Best";
+                    const auto items = "Random\0Best\0Best (FFT)\0Indexed\0Pyramid";
                     if (ImGui::Combo("Block Selection", &selectionIndex, items))
                     {
                         isDirty = true;
@@ -127,10 +131,22 @@ int main()
                         {
                             settings.blockSelection = Quiltis::RandomBlockSelection{};
                         }
-                        else
+                        else if (selectionIndex == 1)
                         {
                             settings.blockSelection = Quiltis::WeightedBlockSelection{};
                         }
+                        else if (selectionIndex == 2)
+                        {
+                            settings.blockSelection = Quiltis::FftBlockSelection{};
+                        }
+                        else if (selectionIndex == 3)
+                        {
+                            settings.blockSelection = Quiltis::IndexedBlockSelection{};
+                        }
+                        else
+                        {
+                            settings.blockSelection = Quiltis::PyramidBlockSelection{};
+                        }
                     }
 
                     if (auto* select = std::get_if<Quiltis::WeightedBlockSelection>(&settings.blockSelection))
@@ -146,17 +162,88 @@ int main()
                         ImGui::Unindent(16.0f);
                     }
 
+                    if (auto* select = std::get_if<Quiltis::FftBlockSelection>(&settings.blockSelection))
+                    {
+                        ImGui::Indent(16.0f);
+
+                        ImGui::DragFloat("Selection Span", &select->selectionSpan, 0.01f, 0.f, 1.f);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::Unindent(16.0f);
+                    }
+
+                    if (auto* select = std::get_if<Quiltis::IndexedBlockSelection>(&settings.blockSelection))
+                    {
+                        ImGui::Indent(16.0f);
+
+                        ImGui::DragInt("Candidates", &select->candidateCount, 0.2f, 1, 1024);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::DragInt("Dimensions", &select->dimensions, 0.1f, 1, 64);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::DragInt("Index Stride", &select->indexStride, 0.1f, 1, 16);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::Unindent(16.0f);
+                    }
+
+                    if (auto* select = std::get_if<Quiltis::PyramidBlockSelection>(&settings.blockSelection))
+                    {
+                        ImGui::Indent(16.0f);
+
+                        ImGui::DragInt("Levels", &select->levels, 0.05f, 0, 5);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::DragInt("Survivors", &select->survivorCount, 1.f, 1, 4096);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::DragFloat("Selection Span", &select->selectionSpan, 0.01f, 0.f, 1.f);
+                        isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::Unindent(16.0f);
+                    }
+
                     ImGui::DragInt("Seed", &settings.seed, 0, 0, 10000);
                     isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
 
-                    isDirty = isDirty || ImGui::Checkbox("Show Seams", &settings.showSeams);
-                    isDirty = isDirty || ImGui::Checkbox("Show Difference", &settings.showDifference);
-                    isDirty = isDirty || ImGui::Checkbox("Blend Seams", &settings.blendSeams);
-                    isDirty = isDirty || ImGui::Checkbox("Cut", &settings.doCut);
+                    isRenderDirty = isRenderDirty || ImGui::Checkbox("Show Seams", &settings.showSeams);
+                    isRenderDirty = isRenderDirty || ImGui::Checkbox("Show Difference", &settings.showDifference);
+                    isRenderDirty = isRenderDirty || ImGui::Checkbox("Cut", &settings.doCut);
+
+                    int seamFinderIndex = static_cast<int>(settings.seamFinder);
+                    if (ImGui::Combo("Seam Finder", &seamFinderIndex, "Boundary Cut\0Graph Cut\0"))
+                    {
+                        isDirty = true;
+                        settings.seamFinder = static_cast<Quiltis::SeamFinder>(seamFinderIndex);
+                    }
+
+                    int seamBlendingIndex = static_cast<int>(settings.seamBlending);
+                    if (ImGui::Combo("Seam Blending", &seamBlendingIndex, "None\0Average\0Poisson\0Feather\0"))
+                    {
+                        isRenderDirty = true;
+                        settings.seamBlending = static_cast<Quiltis::SeamBlending>(seamBlendingIndex);
+                    }
+
+                    if (settings.seamBlending == Quiltis::SeamBlending::Feather)
+                    {
+                        ImGui::Indent(16.0f);
+
+                        ImGui::DragInt("Feather Width", &settings.featherWidth, 0.1f, 0, 64);
+                        isRenderDirty = isRenderDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                        ImGui::Unindent(16.0f);
+                    }
+
                     isDirty = isDirty || ImGui::Checkbox("Log Cost", &settings.useLogCost);
                     isDirty = isDirty || ImGui::Checkbox("Make Tileable", &settings.makeTileable);
                     isDirty = isDirty || ImGui::Checkbox("Use Gpu", &settings.useGpuAcceleration);
 
+                    ImGui::DragInt("Threads", &settings.threadCount, 0.1f, 0, 256);
+                    isDirty = isDirty || ImGui::IsItemDeactivatedAfterEdit();
+
+                    isDirty = isDirty || ImGui::InputText("Cache Directory", &settings.cacheDirectory);
+
 
                     if (ImGui::Button("Export"))
                     {
@@ -210,6 +297,7 @@ int main()
         {
 
             isDirty = false;
+            quiltPlan.reset();
 
             if (!sourceImg.loadFromFile(texturePath))
             {
@@ -219,15 +307,31 @@ int main()
             {
                 sourceTexture.loadFromImage(sourceImg);
 
-                settings.overlap = sf::Vector2i(settings.blockSize.x * overlapPercentage, settings.blockSize.y * overlapPercentage);
+                settings.overlap = Quiltis::Vector2i(settings.blockSize.x * overlapPercentage, settings.blockSize.y * overlapPercentage);
 
                 std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
-                auto resultImg = Quiltis::quilt(sourceImg, settings);
+                quiltPlan = Quiltis::plan(sourceImg, settings);
+                std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
+
+                std::cout << "Planning time = " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "[ms]" << std::endl;
+
+                isRenderDirty = true;
+            }
+        }
+
+        if (isRenderDirty)
+        {
+            isRenderDirty = false;
+
+            if (quiltPlan)
+            {
+                std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+                auto resultImg = Quiltis::render(*quiltPlan, sourceImg, settings);
                 std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now();
 
                 resultTexture.loadFromImage(resultImg);
 
-                std::cout << "Time difference = " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "[ms]" << std::endl;
+                std::cout << "Rendering time = " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << "[ms]" << std::endl;
             }
         }
 
@@ -1,632 +1,5265 @@
 #include "quiltis.hpp"
 
+#include <algorithm>
+#include <array>
 #include <numeric>
-#include <unordered_set>
 #include <vector>
 #include <limits>
 #include <random>
 #include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <complex>
+#include <numbers>
+#include <bit>
+#include <optional>
+#include <memory>
+#include <map>
+#include <tuple>
+#include <cstring>
+#include <span>
+#include <filesystem>
+#include <fstream>
+#include <charconv>
+
+#if !defined(QUILTIS_NO_GPU)
+#include <SFML/Graphics.hpp>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace Quiltis
 {
 
 namespace
 {
-    sf::Color lerpColor(sf::Color c1, sf::Color c2, float a)
+    struct Color
     {
-        return sf::Color(
-            std::lerp(c1.r, c2.r, a),
-            std::lerp(c1.g, c2.g, a),
-            std::lerp(c1.b, c2.b, a),
-            std::lerp(c1.a, c2.a, a)
-        );
-    }
+        std::uint8_t r{};
+        std::uint8_t g{};
+        std::uint8_t b{};
+        std::uint8_t a{ 255 };
 
-    struct Vector2iHash
-    {
-        std::size_t operator()(const sf::Vector2i& v) const noexcept
+        constexpr Color() = default;
+
+        constexpr Color(std::uint8_t r, std::uint8_t g, std::uint8_t b, std::uint8_t a = 255) : r(r), g(g), b(b), a(a)
         {
-            return std::hash<int>{}(v.x + v.y * 10000);
         }
     };
 
-    enum class Direction
+    struct IntRect
     {
-        Horizontal,
-        Vertical
+        Vector2i position;
+        Vector2i size;
     };
 
-    std::vector<float> imageDifference(const sf::Image& src, const sf::Image& dest, sf::IntRect srcRect)
+    // Read only RGBA pixels with rows packed together, wherever they're kept: an Image, the caller's view or a cache mapping
+    class ImageRef
     {
-        std::vector<float> difference(srcRect.size.x * srcRect.size.y);
-        auto diffPtr = difference.data();
+    public:
+        ImageRef() = default;
 
-        auto srcPtr = (sf::Color*)src.getPixelsPtr();
-        auto dstPtr = (sf::Color*)dest.getPixelsPtr();
-
-        srcPtr += (srcRect.position.x + srcRect.position.y * src.getSize().x);
+        ImageRef(const std::uint8_t* pixels, Vector2u size) : pixels(pixels), size(size)
+        {
+        }
 
-        const int srcStride = src.getSize().x - srcRect.size.x;
-        const int dstStride = dest.getSize().x - srcRect.size.x;
+        ImageRef(const Image& image) : pixels(image.getPixelsPtr()), size(image.getSize())
+        {
+        }
 
-        const auto dist = [](const sf::Color& c1, const sf::Color c2)
+        Vector2u getSize() const
         {
-            const auto r = c1.r - c2.r;
-            const auto g = c1.g - c2.g;
-            const auto b = c1.b - c2.b;
-            return std::sqrt(r * r + g * g + b * b);
-        };
+            return size;
+        }
 
-        for (int posY = 0; posY < srcRect.size.y; posY++)
+        const std::uint8_t* getPixelsPtr() const
         {
-            for (int posX = 0; posX < srcRect.size.x; posX++)
-            {
-                *diffPtr = dist(*srcPtr, *dstPtr);
-                diffPtr++;
-                srcPtr++;
-                dstPtr++;
-            }
+            return pixels;
+        }
 
-            srcPtr += srcStride;
-            dstPtr += dstStride;
+        Color getPixel(Vector2u pos) const
+        {
+            const std::uint8_t* pixel = pixels + (pos.x + static_cast<std::size_t>(pos.y) * size.x) * 4;
+            return { pixel[0], pixel[1], pixel[2], pixel[3] };
         }
 
-        return difference;
-    }
+    private:
+        const std::uint8_t* pixels{};
+        Vector2u size;
+    };
 
-    template<Direction direction>
-    std::vector<sf::Vector2i> generatePath(const std::vector<float>& differenceMap, sf::Vector2i mapSize)
+    void setPixel(Image& image, Vector2u pos, Color color)
     {
-        std::vector<sf::Vector2i> path;
+        std::uint8_t* pixel = image.getPixelsPtr() + (pos.x + static_cast<std::size_t>(pos.y) * image.getSize().x) * 4;
+        pixel[0] = color.r;
+        pixel[1] = color.g;
+        pixel[2] = color.b;
+        pixel[3] = color.a;
+    }
 
-        struct Node
+    // Makes the image `size` big, an image that already is keeps its storage and pixels
+    void fitImage(Image& image, Vector2u size)
+    {
+        if (image.getSize() != size)
         {
-            sf::Vector2i parent{ -1, -1 };
-            double gScore = std::numeric_limits<double>::max();
-            double fScore = std::numeric_limits<double>::max();
-        };
+            image = Image(size);
+        }
+    }
 
-        static const std::array<sf::Vector2i, 8> directions = {
-            {{-1, 0}, {-1, -1}, {0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}}
-        };
+    Color lerpColor(Color c1, Color c2, float a)
+    {
+        return Color(
+            std::lerp(c1.r, c2.r, a),
+            std::lerp(c1.g, c2.g, a),
+            std::lerp(c1.b, c2.b, a),
+            std::lerp(c1.a, c2.a, a)
+        );
+    }
 
-        const auto getHeuristic = [&](sf::Vector2i pos) -> double
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(int threadCount)
         {
-            if constexpr (direction == Direction::Horizontal)
-            {
-                return mapSize.y - pos.y - 1;
-            }
-            else
+            for (int x = 1; x < threadCount; x++)
             {
-                return mapSize.x - pos.x - 1;
+                workers.emplace_back([this] { workerLoop(); });
             }
-        };
-
-        const auto posToIndex = [&](sf::Vector2i pos)
-        {
-            return pos.x + pos.y * mapSize.x;
-        };
-
-        const auto indexToPos = [&](std::size_t index)
-        {
-            return sf::Vector2i(index % mapSize.x, index / mapSize.x);
-        };
-
-        std::unordered_set<std::size_t> openTiles{};
-
-        std::vector<Node> nodes(differenceMap.size());
+        }
 
-        for (int x = 0; x < (direction == Direction::Horizontal ? mapSize.x : mapSize.y); x++)
+        ~ThreadPool()
         {
-            auto& node = nodes[x];
-            sf::Vector2i pos;
-
-            if constexpr (direction == Direction::Horizontal)
             {
-                pos = { x, 0 };
+                std::lock_guard lock(mutex);
+                stopping = true;
             }
-            else
+            jobAvailable.notify_all();
+
+            for (auto& worker : workers)
             {
-                pos = { 0, x };
+                worker.join();
             }
-
-            node.gScore = 0;
-            node.fScore = getHeuristic(pos);
-            openTiles.insert(posToIndex(pos));
         }
 
-        while (!openTiles.empty())
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int getThreadCount() const
         {
-            double minCost = std::numeric_limits<double>::max();
-            std::size_t minIndex{};
-            for (const auto index : openTiles)
-            {
-                const auto& node = nodes[index];
-                if (node.fScore < minCost)
-                {
-                    minCost = node.fScore;
-                    minIndex = index;
-                }
-            }
+            return static_cast<int>(workers.size()) + 1;
+        }
 
-            auto& current = nodes[minIndex];
-            const auto currentPos = indexToPos(minIndex);
-            if ((direction == Direction::Horizontal ? currentPos.y == mapSize.y - 1 : currentPos.x == mapSize.x - 1))
+        // Calls function(i) for every i in [0, count), the calling thread takes part in the work
+        // so nested calls made from inside a task can't starve the pool
+        template<typename Function>
+        void parallelFor(int count, const Function& function)
+        {
+            if (workers.empty() || count <= 1)
             {
-                sf::Vector2i pos = currentPos;
-                while (pos.x >= 0)
+                for (int x = 0; x < count; x++)
                 {
-                    path.push_back(pos);
-                    const auto parent = nodes[posToIndex(pos)].parent;
-                    nodes[posToIndex(pos)].parent = { -1, -1 };
-                    pos = parent;
+                    function(x);
                 }
-
-                return path;
-
+                return;
             }
 
-            openTiles.erase(minIndex);
+            Job job;
+            job.count = count;
+            job.function = &function;
+            job.invoke = [](const void* function, int index) { (*static_cast<const Function*>(function))(index); };
 
-            for (int x = 0; x < directions.size(); x++)
             {
-                const auto newPos = currentPos + directions[x];
-                if (newPos.x < 0 || newPos.x >= mapSize.x || newPos.y < 0 || newPos.y >= mapSize.y)
-                {
-                    continue;
-                }
-
-                const auto newIndex = posToIndex(newPos);
-                auto& newNode = nodes[newIndex];
-                const auto tempCost = current.gScore + differenceMap[newIndex];
-                if (tempCost < newNode.gScore)
-                {
-                    newNode.parent = currentPos;
-                    newNode.gScore = tempCost;
-                    newNode.fScore = tempCost + getHeuristic(newPos);
-                    openTiles.insert(newIndex);
-                }
+                std::lock_guard lock(mutex);
+                jobs.push_back(&job);
             }
-        }
+            jobAvailable.notify_all();
 
-        return path;
-    }
+            runJob(job);
 
-    template<Direction direction>
-    void cutImage(sf::Image& image, std::vector<sf::Vector2i> path)
-    {
-        std::unordered_set<sf::Vector2i, Vector2iHash> border(path.begin(), path.end());
+            std::unique_lock lock(mutex);
+            std::erase(jobs, &job);
+            jobDone.wait(lock, [&] { return job.users == 0; });
+        }
 
-        static const std::array<sf::Vector2i, 4> directions = {
-            {{-1, 0}, {0, -1}, {1, 0}, {0, 1}}
+    private:
+        struct Job
+        {
+            int count{};
+            const void* function{};
+            void (*invoke)(const void*, int) {};
+            std::atomic<int> next{};
+            int users{};
         };
 
-        std::unordered_set<sf::Vector2i, Vector2iHash> closedTiles{};
-        std::unordered_set<sf::Vector2i, Vector2iHash> openTiles{};
-
-        if constexpr (direction == Direction::Horizontal)
+        static void runJob(Job& job)
         {
-            for (int y = 0; y < image.getSize().y; y++)
+            for (int index = job.next++; index < job.count; index = job.next++)
             {
-                openTiles.insert(sf::Vector2i(0, y));
-            }
-        }
-        else
-        {
-            for (int x = 0; x < image.getSize().x; x++)
-            {
-                openTiles.insert(sf::Vector2i(x, 0));
+                job.invoke(job.function, index);
             }
         }
 
-        while (!openTiles.empty())
+        void workerLoop()
         {
-            const auto pos = *openTiles.begin();
-            openTiles.erase(pos);
-            closedTiles.insert(pos);
-
-            if (border.find(pos) != border.end())
-            {
-                continue;
-            }
-
-            image.setPixel(sf::Vector2u(pos), sf::Color::Transparent);
-
-            for (int x = 0; x < directions.size(); x++)
+            std::unique_lock lock(mutex);
+            while (true)
             {
-                const auto newPos = pos + directions[x];
-                if (newPos.x < 0 || newPos.x >= image.getSize().x || newPos.y < 0 || newPos.y >= image.getSize().y)
+                jobAvailable.wait(lock, [&] { return stopping || !jobs.empty(); });
+                if (stopping)
                 {
-                    continue;
+                    return;
                 }
 
-                if (closedTiles.find(newPos) != closedTiles.end())
+                auto& job = *jobs.front();
+                job.users++;
+
+                lock.unlock();
+                runJob(job);
+                lock.lock();
+
+                std::erase(jobs, &job);
+                if (--job.users == 0)
                 {
-                    continue;
+                    jobDone.notify_all();
                 }
-
-                openTiles.insert(newPos);
             }
         }
-    }
 
-    template<typename RndEngine>
-    sf::Vector2i selectRandomBlock(RndEngine& rngEngine, const sf::Image& srcImage, sf::Vector2i blockSize)
-    {
-        std::uniform_int_distribution<int> srcDistX(0, srcImage.getSize().x - blockSize.x);
-        std::uniform_int_distribution<int> srcDistY(0, srcImage.getSize().y - blockSize.y);
-        return { srcDistX(rngEngine), srcDistY(rngEngine) };
-    }
+        std::vector<std::thread> workers;
+        std::deque<Job*> jobs;
+        std::mutex mutex;
+        std::condition_variable jobAvailable;
+        std::condition_variable jobDone;
+        bool stopping = false;
+    };
 
-    template<typename RndEngine>
-    sf::Vector2i weightedSelection(RndEngine& rngEngine, const std::uint32_t* data, sf::Vector2i area, float selectionSpan)
+    enum class OverlapKind
     {
-        const auto count = area.x * area.y;
-        std::vector<std::size_t> idx(count);
-        std::iota(idx.begin(), idx.end(), 0);
-
-        std::sort(idx.begin(), idx.end(), [&](size_t i1, size_t i2) {return data[i1] < data[i2]; });
-
-        std::uniform_int_distribution<int> selectionDistribution(0, count * selectionSpan);
-        const auto selectionIndex = idx[selectionDistribution(rngEngine)];
+        Top,
+        Left,
+        Both
+    };
 
-        const sf::Vector2i bestPos(selectionIndex % area.x, selectionIndex / area.x);
+    OverlapKind getOverlapKind(Vector2i blockPos)
+    {
+        if (blockPos.x > 0 && blockPos.y > 0)
+        {
+            return OverlapKind::Both;
+        }
 
-        return bestPos;
+        return blockPos.x > 0 ? OverlapKind::Left : OverlapKind::Top;
     }
 
-    sf::Shader& getBlockSelectionShader()
+    // Strided view over RGBA8 pixels, used to compare regions in place instead of copying them out
+    struct PixelView
     {
-        static constexpr std::string_view vertSrc = R"===(
-void main()
-{
-    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-    gl_TexCoord[0] = gl_MultiTexCoord0;
-    gl_FrontColor = gl_Color;
-}
-)===";
-
-        static constexpr std::string_view  fragSrc = R"===(
-#version 130
+        const std::uint8_t* data{};
+        std::ptrdiff_t stride{};
 
-uniform ivec2 srcSize;
-uniform sampler2D srcTexture;
+        PixelView() = default;
 
-uniform ivec2 blockSize;
-uniform sampler2D blockTexture;
+        PixelView(const std::uint8_t* data, std::ptrdiff_t stride) : data(data), stride(stride)
+        {
+        }
 
-uniform ivec2 topOverlap;
-uniform ivec2 leftOverlap;
-uniform int corse;
+        PixelView(const ImageRef& image, Vector2i pos = {}) : stride(static_cast<std::ptrdiff_t>(image.getSize().x) * 4)
+        {
+            data = image.getPixelsPtr() + pos.x * 4 + pos.y * stride;
+        }
 
-void main()
-{
-    vec2 blockPos = gl_TexCoord[0].xy;
-    
-    float count = float(topOverlap.x * topOverlap.y + leftOverlap.x * leftOverlap.y - topOverlap.y * leftOverlap.x);
-    float error = 0.f;
+        const std::uint8_t* row(int y, int x = 0) const
+        {
+            return data + y * stride + x * 4;
+        }
+    };
 
-    for(int y = 0; y < topOverlap.y; y += corse)
+    void imageDifference(PixelView src, PixelView dest, Vector2i size, std::vector<float>& difference)
     {
-        for(int x = 0; x < topOverlap.x; x += corse)
+        difference.resize(size.x * size.y);
+        auto diffPtr = difference.data();
+
+        const auto dist = [](const std::uint8_t* c1, const std::uint8_t* c2)
         {
-            vec2 offset = vec2(x + 0.5, y + 0.5);
-            vec4 blockPixel = texture2D(blockTexture, offset / blockSize);
-            vec4 srcPixel = texture2D(srcTexture, (blockPos + offset) / srcSize);
-            float diff = length(blockPixel - srcPixel);
-            error += diff;
+            const auto r = c1[0] - c2[0];
+            const auto g = c1[1] - c2[1];
+            const auto b = c1[2] - c2[2];
+            return std::sqrt(r * r + g * g + b * b);
+        };
+
+        for (int posY = 0; posY < size.y; posY++)
+        {
+            const std::uint8_t* srcPtr = src.row(posY);
+            const std::uint8_t* dstPtr = dest.row(posY);
+            for (int posX = 0; posX < size.x; posX++, srcPtr += 4, dstPtr += 4)
+            {
+                *diffPtr = dist(srcPtr, dstPtr);
+                diffPtr++;
+            }
         }
     }
 
-    for(int y = topOverlap.y; y < leftOverlap.y; y += corse)
+    // Sum of the RGB distances between two rows of RGBA8 pixels, alpha is ignored like in imageDifference
+    float rowDistanceSum(const std::uint8_t* a, const std::uint8_t* b, int count)
     {
-        for(int x = 0; x < leftOverlap.x; x += corse)
+        int x = 0;
+        float sum = 0.f;
+
+#if defined(__AVX2__)
         {
-            vec2 offset = vec2(x + 0.5, y + 0.5);
-            vec4 blockPixel = texture2D(blockTexture, offset / blockSize);
-            vec4 srcPixel = texture2D(srcTexture, (blockPos + offset) / srcSize);
-            float diff = length(blockPixel - srcPixel);            
-            error += diff;
-        }
-    }
+            const auto rgbMask = _mm256_set1_epi32(0x00FFFFFF);
+            const auto zero = _mm256_setzero_si256();
+            auto accumulator = _mm256_setzero_ps();
 
-    error /= count;
+            for (; x + 8 <= count; x += 8)
+            {
+                const auto pixelsA = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(a + x * 4)), rgbMask);
+                const auto pixelsB = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(b + x * 4)), rgbMask);
 
-    uint data = uint(error * 255);
-    gl_FragColor = vec4(
-        float((data >> uint(24)) & uint(0xFF)) / 255.f,
-        float((data >> uint(16)) & uint(0xFF)) / 255.f,
-        float((data >> uint(8)) & uint(0xFF)) / 255.f,
-        float((data >> uint(0)) & uint(0xFF)) / 255.f
-    );
-}
-)===";
+                const auto differenceLow = _mm256_sub_epi16(_mm256_unpacklo_epi8(pixelsA, zero), _mm256_unpacklo_epi8(pixelsB, zero));
+                const auto differenceHigh = _mm256_sub_epi16(_mm256_unpackhi_epi8(pixelsA, zero), _mm256_unpackhi_epi8(pixelsB, zero));
 
-        static sf::Shader shader(vertSrc, fragSrc);
-        return shader;
-    }
+                // Each pixel ends up as two partial sums, r² + g² and b² + a²
+                const auto squaresLow = _mm256_cvtepi32_ps(_mm256_madd_epi16(differenceLow, differenceLow));
+                const auto squaresHigh = _mm256_cvtepi32_ps(_mm256_madd_epi16(differenceHigh, differenceHigh));
 
-    template<typename RndEngine>
-    sf::Vector2i selectBestBlockGpu(const WeightedBlockSelection& settings, RndEngine& rngEngine, const sf::Texture& srcTexture, const sf::Image& quiltImage, sf::Vector2i blockSize, sf::Vector2i blockPos, sf::Vector2i overlap)
-    {
-        const auto area = sf::Vector2i(srcTexture.getSize()) - blockSize;
-        std::vector<float> blockErrors(area.x * area.y);
-        sf::RenderTexture target{ sf::Vector2u(area) };
+                const auto squares = _mm256_add_ps(
+                    _mm256_shuffle_ps(squaresLow, squaresHigh, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm256_shuffle_ps(squaresLow, squaresHigh, _MM_SHUFFLE(3, 1, 3, 1)));
 
-        sf::Vector2i topOverlap(blockSize.x, overlap.y);
-        sf::Vector2i leftOverlap(overlap.x, blockSize.y);
+                accumulator = _mm256_add_ps(accumulator, _mm256_sqrt_ps(squares));
+            }
 
-        if (blockPos.x == 0)
-        {
-            leftOverlap = {};
+            alignas(32) float lanes[8];
+            _mm256_store_ps(lanes, accumulator);
+            for (const auto lane : lanes)
+            {
+                sum += lane;
+            }
         }
+#endif
 
-        if (blockPos.y == 0)
+#if defined(__SSE2__) || defined(_M_X64)
         {
-            topOverlap = {};
-        }
+            const auto rgbMask = _mm_set1_epi32(0x00FFFFFF);
+            const auto zero = _mm_setzero_si128();
+            auto accumulator = _mm_setzero_ps();
 
-        sf::Texture blockTexture(quiltImage, false, { blockPos, blockSize });
-        blockTexture.setSmooth(0);
+            for (; x + 4 <= count; x += 4)
+            {
+                const auto pixelsA = _mm_and_si128(_mm_loadu_si128((const __m128i*)(a + x * 4)), rgbMask);
+                const auto pixelsB = _mm_and_si128(_mm_loadu_si128((const __m128i*)(b + x * 4)), rgbMask);
 
-        auto& shader = getBlockSelectionShader();
+                const auto differenceLow = _mm_sub_epi16(_mm_unpacklo_epi8(pixelsA, zero), _mm_unpacklo_epi8(pixelsB, zero));
+                const auto differenceHigh = _mm_sub_epi16(_mm_unpackhi_epi8(pixelsA, zero), _mm_unpackhi_epi8(pixelsB, zero));
 
-        sf::RenderStates renderStates{};
-        renderStates.shader = &shader;
-        renderStates.coordinateType = sf::CoordinateType::Pixels;
-        renderStates.blendMode = sf::BlendNone;
+                const auto squaresLow = _mm_cvtepi32_ps(_mm_madd_epi16(differenceLow, differenceLow));
+                const auto squaresHigh = _mm_cvtepi32_ps(_mm_madd_epi16(differenceHigh, differenceHigh));
 
-        shader.setUniform("srcTexture", srcTexture);
-        shader.setUniform("srcSize", sf::Vector2i(srcTexture.getSize()));
-        shader.setUniform("blockTexture", blockTexture);
-        shader.setUniform("blockSize", blockSize);
-        shader.setUniform("overlap", overlap);
-        shader.setUniform("topOverlap", topOverlap);
-        shader.setUniform("leftOverlap", leftOverlap);
-        shader.setUniform("corse", settings.searchStride);
+                const auto squares = _mm_add_ps(
+                    _mm_shuffle_ps(squaresLow, squaresHigh, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm_shuffle_ps(squaresLow, squaresHigh, _MM_SHUFFLE(3, 1, 3, 1)));
 
-        sf::RectangleShape shape{ sf::Vector2f(area) };
-        shape.setTextureRect({ {}, area });
+                accumulator = _mm_add_ps(accumulator, _mm_sqrt_ps(squares));
+            }
 
-        target.draw(shape, renderStates);
-        target.display();
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, accumulator);
+            for (const auto lane : lanes)
+            {
+                sum += lane;
+            }
+        }
+#endif
 
-        const auto result = target.getTexture().copyToImage();
+        for (; x < count; x++)
+        {
+            const int r = a[x * 4 + 0] - b[x * 4 + 0];
+            const int g = a[x * 4 + 1] - b[x * 4 + 1];
+            const int bl = a[x * 4 + 2] - b[x * 4 + 2];
+            sum += std::sqrt(static_cast<float>(r * r + g * g + bl * bl));
+        }
 
-        std::uint32_t minError = std::numeric_limits<std::int32_t>::max();
-        std::uint32_t minIndex{};
+        return sum;
+    }
 
-        const auto count = result.getSize().x * result.getSize().y;
+    // RGBA pixels being drawn into, an Image or rows belonging to the caller
+    class Canvas
+    {
+    public:
+        explicit Canvas(Image& image) : Canvas(image.getPixelsPtr(), image.getSize(), static_cast<std::size_t>(image.getSize().x) * 4)
+        {
+        }
 
-        auto ptr = (std::uint32_t*)result.getPixelsPtr();
+        Canvas(std::uint8_t* pixels, Vector2u size, std::size_t stride) : pixels(pixels), size(size), stride(stride)
+        {
+        }
 
-        return weightedSelection(rngEngine, ptr, area, settings.selectionSpan);
-    }
+        Vector2u getSize() const
+        {
+            return size;
+        }
 
-    template<typename RndEngine>
-    sf::Vector2i selectBestBlockCpu(const WeightedBlockSelection& settings, RndEngine& rngEngine, const sf::Image& srcImage, const sf::Image& quiltImage, sf::Vector2i blockSize, sf::Vector2i blockPos, sf::Vector2i overlap)
-    {
-        const auto area = sf::Vector2i(srcImage.getSize()) - blockSize;
+        PixelView getView(Vector2i pos = {}) const
+        {
+            return { pixels + pos.x * 4 + pos.y * static_cast<std::ptrdiff_t>(stride), static_cast<std::ptrdiff_t>(stride) };
+        }
 
-        sf::Image blockImage{ sf::Vector2u(blockSize) };
+        Color getPixel(Vector2u pos) const
+        {
+            const std::uint8_t* pixel = getRow(pos.y) + pos.x * 4;
+            return { pixel[0], pixel[1], pixel[2], pixel[3] };
+        }
 
-        const sf::Vector2i topOverlap(blockSize.x, overlap.y);
-        const sf::Vector2i leftOverlap(overlap.x, blockSize.y);
+        void setPixel(Vector2u pos, Color color)
+        {
+            std::uint8_t* pixel = getRow(pos.y) + pos.x * 4;
+            pixel[0] = color.r;
+            pixel[1] = color.g;
+            pixel[2] = color.b;
+            pixel[3] = color.a;
+        }
 
-        const auto average = [&](auto vec, auto offset) -> float
+        Image copyRegion(IntRect rect) const
         {
-            auto const count = static_cast<float>(vec.size() - offset);
-            return std::reduce(vec.begin() + offset, vec.end()) / count;
-        };
+            Image region;
+            copyRegion(rect, region);
+            return region;
+        }
 
-        std::vector<std::uint32_t> blockErrors(area.x * area.y);
-        for (int y = 0; y < area.y; y += settings.searchStride)
+        void copyRegion(IntRect rect, Image& region) const
         {
-            for (int x = 0; x < area.x; x += settings.searchStride)
+            fitImage(region, Vector2u(rect.size));
+            const auto rowSize = static_cast<std::size_t>(rect.size.x) * 4;
+            const auto view = getView(rect.position);
+            for (int y = 0; y < rect.size.y; y++)
             {
-                blockImage.copy(srcImage, {}, { {x, y}, blockSize });
-                std::vector<float> topDifference = imageDifference(quiltImage, blockImage, { blockPos, topOverlap });
-                std::vector<float> leftDifference = imageDifference(quiltImage, blockImage, { blockPos, leftOverlap });
-
-                const auto topAverage = average(topDifference, 0);
-                const auto leftAverage = average(leftDifference, topOverlap.y * leftOverlap.x);
-                const auto average = (topAverage + leftAverage) / 2.f;
-                blockErrors[x + y * area.x] = average * 255.f;
+                std::memcpy(region.getPixelsPtr() + y * rowSize, view.row(y), rowSize);
             }
         }
 
-        return weightedSelection(rngEngine, blockErrors.data(), area, settings.selectionSpan);
-    }
-}
+        // Copies `count` pixels from `source` to `dest` as they are, or composites them over the canvas by their alpha
+        // with the same integer rounding sf::Image::copy uses
+        void copy(PixelView source, Vector2u dest, Vector2i count, bool applyAlpha = false)
+        {
+            for (int y = 0; y < count.y; y++)
+            {
+                const std::uint8_t* from = source.row(y);
+                std::uint8_t* to = getRow(dest.y + y) + dest.x * 4;
+                if (!applyAlpha)
+                {
+                    std::memcpy(to, from, static_cast<std::size_t>(count.x) * 4);
+                    continue;
+                }
 
-sf::Image quilt(const sf::Image& sourceImage, const Settings& settings)
-{
-    const auto overlap = settings.overlap;
-    const auto blockSize = settings.blockSize;
-    const auto quiltSize = settings.quiltSize;
+                for (int x = 0; x < count.x; x++, from += 4, to += 4)
+                {
+                    // Opaque pixels come out as they are, which is most of a feathered or cut block
+                    const int sourceAlpha = from[3];
+                    if (sourceAlpha == 255)
+                    {
+                        std::memcpy(to, from, 4);
+                        continue;
+                    }
+
+                    const auto alpha = static_cast<std::uint8_t>(sourceAlpha + to[3] - sourceAlpha * to[3] / 255);
+                    for (int c = 0; c < 3; c++)
+                    {
+                        to[c] = alpha ? static_cast<std::uint8_t>((from[c] * sourceAlpha + to[c] * (alpha - sourceAlpha)) / alpha) : from[c];
+                    }
+                    to[3] = alpha;
+                }
+            }
+        }
+
+        // Replaces every pixel with tightly packed ones
+        void assign(const std::uint8_t* packed)
+        {
+            const auto rowSize = static_cast<std::size_t>(size.x) * 4;
+            for (unsigned int y = 0; y < size.y; y++)
+            {
+                std::memcpy(getRow(y), packed + y * rowSize, rowSize);
+            }
+        }
+
+    private:
+        std::uint8_t* getRow(unsigned int y) const
+        {
+            return pixels + y * stride;
+        }
+
+        std::uint8_t* pixels{};
+        Vector2u size;
+        std::size_t stride{};
+    };
+
+    // RGB planes of an image, alpha is left out since matching ignores it. With a stride s every row of a plane is split in s phases,
+    // phase p holding pixels p, p + s, p + 2s... so candidates s pixels apart, like a search grid's, find any pixel of theirs at
+    // consecutive bytes and can be scored side by side in vector lanes. Rows are padded so vector loads can run past their end
+    class PlanarImage
+    {
+    public:
+        static constexpr int padding = 32;
+
+        PlanarImage(const ImageRef& image, int stride) :
+            stride(stride),
+            pitch(((static_cast<int>(image.getSize().x) + stride - 1) / stride + padding + 31) / 32 * 32),
+            pixels(static_cast<std::size_t>(pitch) * image.getSize().y * stride * 3)
+        {
+            const auto size = Vector2i(image.getSize());
+            const std::uint8_t* src = image.getPixelsPtr();
+            for (int y = 0; y < size.y; y++)
+            {
+                for (int x = 0; x < size.x; x++)
+                {
+                    for (int c = 0; c < 3; c++)
+                    {
+                        row(y, x % stride, c)[x / stride] = src[(x + static_cast<std::size_t>(y) * size.x) * 4 + c];
+                    }
+                }
+            }
+        }
+
+        const std::uint8_t* row(int y, int phase, int channel) const
+        {
+            return &pixels[((static_cast<std::size_t>(y) * stride + phase) * 3 + channel) * pitch];
+        }
+
+        int getStride() const
+        {
+            return stride;
+        }
+
+        // Bytes between the planes of a row, which follow each other phase by phase
+        int getPitch() const
+        {
+            return pitch;
+        }
+
+    private:
+        std::uint8_t* row(int y, int phase, int channel)
+        {
+            return &pixels[((static_cast<std::size_t>(y) * stride + phase) * 3 + channel) * pitch];
+        }
+
+        int stride;
+        int pitch;
+        std::vector<std::uint8_t> pixels;
+    };
+
+    // costs[x] = errors[x] + min(previous[x - 1], previous[x], previous[x + 1]), previous has to be readable one past both ends
+    void accumulateSeamRow(const float* previous, const float* errors, float* costs, int count)
+    {
+        int x = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+        for (; x + 4 <= count; x += 4)
+        {
+            const auto left = _mm_loadu_ps(previous + x - 1);
+            const auto middle = _mm_loadu_ps(previous + x);
+            const auto right = _mm_loadu_ps(previous + x + 1);
+            _mm_storeu_ps(costs + x, _mm_add_ps(_mm_loadu_ps(errors + x), _mm_min_ps(_mm_min_ps(left, middle), right)));
+        }
+#endif
+
+        for (; x < count; x++)
+        {
+            costs[x] = errors[x] + std::min(std::min(previous[x - 1], previous[x]), previous[x + 1]);
+        }
+    }
+
+    // Cumulative costs of minimum error boundary cuts through a strip of `length` rows by `width` pixels, by dynamic programming
+    // like in the quilting paper: reaching a pixel costs its error plus the cheapest of the three pixels touching it in the row before.
+    // Rows are padded with an infinite cost on both sides so the three neighbour min has no edge cases.
+    // Storage is kept between compute() calls so the costs of every block can reuse it
+    class SeamCosts
+    {
+    public:
+        // fillErrors(row, errors) writes the `width` errors of a row
+        template<typename FillErrors>
+        void compute(int width, int length, FillErrors&& fillErrors)
+        {
+            this->width = width;
+            stride = width + 2;
+            costs.assign(static_cast<std::size_t>(stride) * length, std::numeric_limits<float>::infinity());
+            errors.resize(width);
+            for (int row = 0; row < length; row++)
+            {
+                fillErrors(row, errors.data());
+
+                const auto rowCosts = getRow(row);
+                if (row == 0)
+                {
+                    std::copy(errors.begin(), errors.end(), rowCosts);
+                }
+                else
+                {
+                    accumulateSeamRow(rowCosts - stride, errors.data(), rowCosts, width);
+                }
+            }
+        }
+
+        float getCost(int row, int column) const
+        {
+            return getRow(row)[column];
+        }
+
+        int getCheapestColumn(int row) const
+        {
+            const auto rowCosts = getRow(row);
+            return static_cast<int>(std::min_element(rowCosts, rowCosts + width) - rowCosts);
+        }
+
+        // Calls onCut(row, column) with the column of the cheapest cut on every row from `row`, where it goes through `column`,
+        // back to the first one. Follows whichever neighbour gave each minimum, going straight on ties
+        template<typename OnCut>
+        void trace(int row, int column, OnCut&& onCut) const
+        {
+            for (; row >= 0; row--)
+            {
+                onCut(row, column);
+                if (row == 0)
+                {
+                    break;
+                }
+
+                const auto previous = getRow(row - 1);
+                int next = column;
+                if (previous[column - 1] < previous[next])
+                {
+                    next = column - 1;
+                }
+                if (previous[column + 1] < previous[next])
+                {
+                    next = column + 1;
+                }
+                column = next;
+            }
+        }
+
+    private:
+        float* getRow(int row)
+        {
+            return &costs[static_cast<std::size_t>(row) * stride + 1];
+        }
+
+        const float* getRow(int row) const
+        {
+            return &costs[static_cast<std::size_t>(row) * stride + 1];
+        }
+
+        int width{};
+        int stride{};
+        std::vector<float> costs;
+        std::vector<float> errors;
+    };
+
+    // How a block is cut along its overlap: on row y the first rowEnds[y] pixels are cleared and on column x the first columnEnds[x],
+    // the seam pixels themselves are kept
+    struct BlockCut
+    {
+        std::vector<int> rowEnds;
+        std::vector<int> columnEnds;
+        std::vector<Vector2i> seam;
+
+        // Cuts that can't be told by their ends, like graph cuts, mark every cleared pixel of the block instead
+        std::vector<std::uint8_t> cleared;
+    };
+
+    // The overlap is the top strip, of blockSize.x by overlap.y, and the left strip under it, of overlap.x by the remaining height,
+    // either can be empty. The left seam is solved from the bottom edge up and the top one from the right edge in, so both halves
+    // of an L shaped overlap can meet at the corner pixel where their combined cost is lowest and the corner is only cut once
+    void findBlockCut(const std::vector<float>& topErrors, const std::vector<float>& leftErrors, Vector2i blockSize, Vector2i overlap, OverlapKind kind,
+        SeamCosts& leftCosts, SeamCosts& topCosts, BlockCut& cut)
+    {
+        const bool hasTop = kind != OverlapKind::Left;
+        const bool hasLeft = kind != OverlapKind::Top;
+        const int topHeight = hasTop ? overlap.y : 0;
+
+        const auto errorAt = [&](int x, int y)
+        {
+            return y < topHeight ? topErrors[x + static_cast<std::size_t>(y) * blockSize.x] : leftErrors[x + static_cast<std::size_t>(y - topHeight) * overlap.x];
+        };
+
+        if (hasLeft)
+        {
+            leftCosts.compute(overlap.x, blockSize.y, [&](int row, float* errors)
+            {
+                for (int x = 0; x < overlap.x; x++)
+                {
+                    errors[x] = errorAt(x, blockSize.y - 1 - row);
+                }
+            });
+        }
+
+        if (hasTop)
+        {
+            topCosts.compute(overlap.y, blockSize.x, [&](int row, float* errors)
+            {
+                for (int y = 0; y < overlap.y; y++)
+                {
+                    errors[y] = errorAt(blockSize.x - 1 - row, y);
+                }
+            });
+        }
+
+        // Where the halves meet, the left seam starts there and goes down and the top one starts there and goes right
+        Vector2i meeting;
+        if (kind == OverlapKind::Left)
+        {
+            meeting = { leftCosts.getCheapestColumn(blockSize.y - 1), 0 };
+        }
+        else if (kind == OverlapKind::Top)
+        {
+            meeting = { 0, topCosts.getCheapestColumn(blockSize.x - 1) };
+        }
+        else
+        {
+            float minCost = std::numeric_limits<float>::infinity();
+            for (int y = 0; y < overlap.y; y++)
+            {
+                for (int x = 0; x < overlap.x; x++)
+                {
+                    const auto cost = leftCosts.getCost(blockSize.y - 1 - y, x) + topCosts.getCost(blockSize.x - 1 - x, y) - errorAt(x, y);
+                    if (cost < minCost)
+                    {
+                        minCost = cost;
+                        meeting = { x, y };
+                    }
+                }
+            }
+        }
+
+        // Everything above and left of the meeting pixel is on the quilt's side
+        cut.rowEnds.assign(blockSize.y, 0);
+        cut.columnEnds.assign(blockSize.x, 0);
+        cut.seam.clear();
+        cut.cleared.clear();
+        std::fill_n(cut.rowEnds.begin(), meeting.y, meeting.x);
+        std::fill_n(cut.columnEnds.begin(), meeting.x, meeting.y);
+
+        // Traces run from the meeting pixel outwards, so seam pixels are listed in the same order as going inwards from the edges
+        if (hasLeft)
+        {
+            leftCosts.trace(blockSize.y - 1 - meeting.y, meeting.x, [&](int row, int column)
+            {
+                cut.rowEnds[blockSize.y - 1 - row] = column;
+            });
+            for (int y = meeting.y; y < blockSize.y; y++)
+            {
+                cut.seam.emplace_back(cut.rowEnds[y], y);
+            }
+        }
+
+        if (hasTop)
+        {
+            topCosts.trace(blockSize.x - 1 - meeting.x, meeting.y, [&](int row, int column)
+            {
+                cut.columnEnds[blockSize.x - 1 - row] = column;
+            });
+            for (int x = meeting.x; x < blockSize.x; x++)
+            {
+                if (!hasLeft || x > meeting.x)
+                {
+                    cut.seam.emplace_back(x, cut.columnEnds[x]);
+                }
+            }
+        }
+    }
+
+    // Boykov-Kolmogorov max flow, search trees grown from both terminals are kept and repaired between augmenting paths
+    // instead of searching again from scratch. Storage is kept by reset() so a solver reused for every block stops allocating
+    class MaxFlow
+    {
+    public:
+        void reset(int nodeCount)
+        {
+            nodes.assign(nodeCount, Node{});
+            arcs.clear();
+            activeFirst = none;
+            activeLast = none;
+            orphans.clear();
+            time = 0;
+        }
+
+        void addEdge(int from, int to, float capacity, float reverseCapacity)
+        {
+            const auto arc = static_cast<int>(arcs.size());
+            arcs.push_back({ to, nodes[from].first, arc + 1, capacity });
+            arcs.push_back({ from, nodes[to].first, arc, reverseCapacity });
+            nodes[from].first = arc;
+            nodes[to].first = arc + 1;
+        }
+
+        // Only the difference matters, whatever both terminals share flows straight through the node
+        void setTerminalCapacities(int node, float source, float sink)
+        {
+            nodes[node].terminalCapacity = source - sink;
+        }
+
+        void solve()
+        {
+            for (int i = 0; i < static_cast<int>(nodes.size()); i++)
+            {
+                auto& node = nodes[i];
+                if (node.terminalCapacity != 0.f)
+                {
+                    node.isSink = node.terminalCapacity < 0.f;
+                    node.parent = terminal;
+                    node.timestamp = 0;
+                    node.distance = 1;
+                    setActive(i);
+                }
+            }
+
+            int current = none;
+            while (true)
+            {
+                int i = current;
+                if (i != none)
+                {
+                    nodes[i].next = none;
+                    if (nodes[i].parent == none)
+                    {
+                        i = none;
+                    }
+                }
+
+                if (i == none)
+                {
+                    i = nextActive();
+                    if (i == none)
+                    {
+                        break;
+                    }
+                }
+
+                const int middleArc = grow(i);
+
+                time++;
+                if (middleArc == none)
+                {
+                    current = none;
+                    continue;
+                }
+
+                // Keeps i marked active while it's the current node
+                nodes[i].next = i;
+                current = i;
+
+                augment(middleArc);
+
+                for (std::size_t x = 0; x < orphans.size(); x++)
+                {
+                    adopt(orphans[x]);
+                }
+                orphans.clear();
+            }
+        }
+
+        // Whether the minimum cut leaves the node with the source, free nodes go with the sink
+        bool isSourceSide(int node) const
+        {
+            return nodes[node].parent != none && !nodes[node].isSink;
+        }
+
+    private:
+        static constexpr int none = -1;
+        static constexpr int terminal = -2;
+        static constexpr int orphan = -3;
+
+        struct Node
+        {
+            int first = none;
+            int parent = none;
+            int next = none;
+            int timestamp{};
+            int distance{};
+            bool isSink{};
+            float terminalCapacity{};
+        };
+
+        struct Arc
+        {
+            int head;
+            int next;
+            int sister;
+            float capacity;
+        };
+
+        // The tail of an arc is the head of its sister
+        int getTail(int arc) const
+        {
+            return arcs[arcs[arc].sister].head;
+        }
+
+        void setActive(int node)
+        {
+            if (nodes[node].next == none)
+            {
+                if (activeLast != none)
+                {
+                    nodes[activeLast].next = node;
+                }
+                else
+                {
+                    activeFirst = node;
+                }
+                activeLast = node;
+                nodes[node].next = node;
+            }
+        }
+
+        // Active nodes that lost their tree while queued are skipped
+        int nextActive()
+        {
+            while (activeFirst != none)
+            {
+                const int node = activeFirst;
+                if (nodes[node].next == node)
+                {
+                    activeFirst = activeLast = none;
+                }
+                else
+                {
+                    activeFirst = nodes[node].next;
+                }
+                nodes[node].next = none;
+
+                if (nodes[node].parent != none)
+                {
+                    return node;
+                }
+            }
+            return none;
+        }
+
+        // Extends i's tree over its residual arcs, returns the arc from the source tree to the sink tree if they touch
+        int grow(int i)
+        {
+            const bool isSink = nodes[i].isSink;
+            for (int arc = nodes[i].first; arc != none; arc = arcs[arc].next)
+            {
+                const auto residual = isSink ? arcs[arcs[arc].sister].capacity : arcs[arc].capacity;
+                if (residual <= 0.f)
+                {
+                    continue;
+                }
+
+                const int j = arcs[arc].head;
+                auto& neighbour = nodes[j];
+                if (neighbour.parent == none)
+                {
+                    neighbour.isSink = isSink;
+                    neighbour.parent = arcs[arc].sister;
+                    neighbour.timestamp = nodes[i].timestamp;
+                    neighbour.distance = nodes[i].distance + 1;
+                    setActive(j);
+                }
+                else if (neighbour.isSink != isSink)
+                {
+                    return isSink ? arcs[arc].sister : arc;
+                }
+                else if (neighbour.timestamp <= nodes[i].timestamp && neighbour.distance > nodes[i].distance)
+                {
+                    // Shorter paths to the terminal make later augmentations cheaper
+                    neighbour.parent = arcs[arc].sister;
+                    neighbour.timestamp = nodes[i].timestamp;
+                    neighbour.distance = nodes[i].distance + 1;
+                }
+            }
+            return none;
+        }
+
+        void setOrphan(int node)
+        {
+            nodes[node].parent = orphan;
+            orphans.push_back(node);
+        }
+
+        void augment(int middleArc)
+        {
+            // Source tree parent arcs point towards the source and carry flow through their sister, sink tree ones the other way
+            float bottleneck = arcs[middleArc].capacity;
+            int i = getTail(middleArc);
+            for (; nodes[i].parent != terminal; i = arcs[nodes[i].parent].head)
+            {
+                bottleneck = std::min(bottleneck, arcs[arcs[nodes[i].parent].sister].capacity);
+            }
+            bottleneck = std::min(bottleneck, nodes[i].terminalCapacity);
+
+            i = arcs[middleArc].head;
+            for (; nodes[i].parent != terminal; i = arcs[nodes[i].parent].head)
+            {
+                bottleneck = std::min(bottleneck, arcs[nodes[i].parent].capacity);
+            }
+            bottleneck = std::min(bottleneck, -nodes[i].terminalCapacity);
+
+            arcs[arcs[middleArc].sister].capacity += bottleneck;
+            arcs[middleArc].capacity -= bottleneck;
+
+            for (i = getTail(middleArc); nodes[i].parent != terminal;)
+            {
+                auto& arc = arcs[nodes[i].parent];
+                arc.capacity += bottleneck;
+                arcs[arc.sister].capacity -= bottleneck;
+
+                const int parent = arc.head;
+                if (arcs[arc.sister].capacity == 0.f)
+                {
+                    setOrphan(i);
+                }
+                i = parent;
+            }
+            nodes[i].terminalCapacity -= bottleneck;
+            if (nodes[i].terminalCapacity == 0.f)
+            {
+                setOrphan(i);
+            }
+
+            for (i = arcs[middleArc].head; nodes[i].parent != terminal;)
+            {
+                auto& arc = arcs[nodes[i].parent];
+                arcs[arc.sister].capacity += bottleneck;
+                arc.capacity -= bottleneck;
+
+                const int parent = arc.head;
+                if (arc.capacity == 0.f)
+                {
+                    setOrphan(i);
+                }
+                i = parent;
+            }
+            nodes[i].terminalCapacity += bottleneck;
+            if (nodes[i].terminalCapacity == 0.f)
+            {
+                setOrphan(i);
+            }
+        }
+
+        // Looks for a new parent in the orphan's own tree that still leads to the terminal, preferring the closest one.
+        // Without one the orphan becomes free and its children become orphans in turn
+        void adopt(int i)
+        {
+            const bool isSink = nodes[i].isSink;
+            const auto residualTowardsTree = [&](int arc) { return isSink ? arcs[arc].capacity : arcs[arcs[arc].sister].capacity; };
+
+            int bestArc = none;
+            int bestDistance = std::numeric_limits<int>::max();
+            for (int arc = nodes[i].first; arc != none; arc = arcs[arc].next)
+            {
+                int j = arcs[arc].head;
+                if (residualTowardsTree(arc) <= 0.f || nodes[j].isSink != isSink || nodes[j].parent == none)
+                {
+                    continue;
+                }
+
+                // Walks up to the terminal, or to a node already known to reach it this round
+                int distance = 0;
+                while (true)
+                {
+                    if (nodes[j].timestamp == time)
+                    {
+                        distance += nodes[j].distance;
+                        break;
+                    }
+
+                    const int parent = nodes[j].parent;
+                    distance++;
+                    if (parent == terminal)
+                    {
+                        nodes[j].timestamp = time;
+                        nodes[j].distance = 1;
+                        break;
+                    }
+                    if (parent == orphan)
+                    {
+                        distance = std::numeric_limits<int>::max();
+                        break;
+                    }
+                    j = arcs[parent].head;
+                }
+
+                if (distance == std::numeric_limits<int>::max())
+                {
+                    continue;
+                }
+
+                if (distance < bestDistance)
+                {
+                    bestArc = arc;
+                    bestDistance = distance;
+                }
+
+                for (j = arcs[arc].head; nodes[j].timestamp != time; j = arcs[nodes[j].parent].head)
+                {
+                    nodes[j].timestamp = time;
+                    nodes[j].distance = distance--;
+                }
+            }
+
+            if (bestArc != none)
+            {
+                nodes[i].parent = bestArc;
+                nodes[i].timestamp = time;
+                nodes[i].distance = bestDistance + 1;
+                return;
+            }
+
+            nodes[i].parent = none;
+            for (int arc = nodes[i].first; arc != none; arc = arcs[arc].next)
+            {
+                const int j = arcs[arc].head;
+                const int parent = nodes[j].parent;
+                if (nodes[j].isSink != isSink || parent == none)
+                {
+                    continue;
+                }
+
+                if (residualTowardsTree(arc) > 0.f)
+                {
+                    setActive(j);
+                }
+
+                if (parent != terminal && parent != orphan && arcs[parent].head == i)
+                {
+                    setOrphan(j);
+                }
+            }
+        }
+
+        std::vector<Node> nodes;
+        std::vector<Arc> arcs;
+        std::vector<int> orphans;
+        int activeFirst = none;
+        int activeLast = none;
+        int time{};
+    };
+
+    // Minimum cut over the overlap pixels like in graph cut texture synthesis, cutting between two touching pixels costs the sum of their
+    // quilt to block differences. Pixels on the block's outer edges must keep the quilt and those next to the block's interior must take
+    // the block, anything in between, corner included, can end up on either side so the seam can take any shape
+    void findGraphCut(MaxFlow& maxFlow, const std::vector<float>& topErrors, const std::vector<float>& leftErrors, Vector2i blockSize, Vector2i overlap, OverlapKind kind,
+        BlockCut& cut)
+    {
+        const bool hasTop = kind != OverlapKind::Left;
+        const bool hasLeft = kind != OverlapKind::Top;
+        const int topHeight = hasTop ? overlap.y : 0;
+        const int leftWidth = hasLeft ? overlap.x : 0;
+
+        // Nodes are the top strip's pixels followed by the left strip's, like the two error maps
+        const auto topCount = static_cast<int>(topErrors.size());
+        const auto isInOverlap = [&](int x, int y) { return y < topHeight || x < leftWidth; };
+        const auto getNode = [&](int x, int y) { return y < topHeight ? x + y * blockSize.x : topCount + x + (y - topHeight) * leftWidth; };
+        const auto getError = [&](int node) { return node < topCount ? topErrors[node] : leftErrors[node - topCount]; };
+
+        maxFlow.reset(topCount + static_cast<int>(leftErrors.size()));
+
+        const auto infinity = std::numeric_limits<float>::infinity();
+        for (int y = 0; y < blockSize.y; y++)
+        {
+            for (int x = 0; x < (y < topHeight ? blockSize.x : leftWidth); x++)
+            {
+                const int node = getNode(x, y);
+                if (x + 1 < blockSize.x && isInOverlap(x + 1, y))
+                {
+                    const auto capacity = getError(node) + getError(getNode(x + 1, y));
+                    maxFlow.addEdge(node, getNode(x + 1, y), capacity, capacity);
+                }
+                if (y + 1 < blockSize.y && isInOverlap(x, y + 1))
+                {
+                    const auto capacity = getError(node) + getError(getNode(x, y + 1));
+                    maxFlow.addEdge(node, getNode(x, y + 1), capacity, capacity);
+                }
+
+                if ((hasLeft && x == 0) || (hasTop && y == 0))
+                {
+                    maxFlow.setTerminalCapacities(node, infinity, 0.f);
+                }
+                else if ((x + 1 < blockSize.x && !isInOverlap(x + 1, y)) || (y + 1 < blockSize.y && !isInOverlap(x, y + 1)))
+                {
+                    maxFlow.setTerminalCapacities(node, 0.f, infinity);
+                }
+            }
+        }
+
+        maxFlow.solve();
+
+        cut.rowEnds.assign(blockSize.y, 0);
+        cut.columnEnds.assign(blockSize.x, 0);
+        cut.seam.clear();
+        cut.cleared.assign(static_cast<std::size_t>(blockSize.x) * blockSize.y, 0);
+
+        for (int y = 0; y < blockSize.y; y++)
+        {
+            for (int x = 0; x < (y < topHeight ? blockSize.x : leftWidth); x++)
+            {
+                cut.cleared[x + static_cast<std::size_t>(y) * blockSize.x] = maxFlow.isSourceSide(getNode(x, y));
+            }
+        }
+
+        // The seam is made of the kept pixels touching a cleared one
+        for (int y = 0; y < blockSize.y; y++)
+        {
+            for (int x = 0; x < (y < topHeight ? blockSize.x : leftWidth); x++)
+            {
+                const auto isCleared = [&](int x, int y) { return x >= 0 && y >= 0 && x < blockSize.x && y < blockSize.y && cut.cleared[x + static_cast<std::size_t>(y) * blockSize.x]; };
+                if (!isCleared(x, y) && (isCleared(x - 1, y) || isCleared(x + 1, y) || isCleared(x, y - 1) || isCleared(x, y + 1)))
+                {
+                    cut.seam.emplace_back(x, y);
+                }
+            }
+        }
+    }
+
+    // Clears the quilt's side of the cut to transparent, along each row that's a run from the left edge
+    // plus the runs of columns whose cut reaches further down, seams move by at most a pixel per step so these are few
+    void cutImage(Image& image, const BlockCut& cut)
+    {
+        const auto width = static_cast<int>(image.getSize().x);
+        std::uint8_t* pixels = image.getPixelsPtr();
+
+        const auto clearRun = [&](int begin, int end, int y)
+        {
+            if (end > begin)
+            {
+                std::memset(pixels + (static_cast<std::size_t>(y) * width + begin) * 4, 0, static_cast<std::size_t>(end - begin) * 4);
+            }
+        };
+
+        const int columnsHeight = *std::max_element(cut.columnEnds.begin(), cut.columnEnds.end());
+        for (int y = 0; y < static_cast<int>(cut.rowEnds.size()); y++)
+        {
+            const int rowEnd = cut.rowEnds[y];
+            clearRun(0, rowEnd, y);
+
+            if (y < columnsHeight)
+            {
+                int begin = rowEnd;
+                for (int x = rowEnd; x <= width; x++)
+                {
+                    if (x == width || cut.columnEnds[x] <= y)
+                    {
+                        clearRun(begin, x, y);
+                        begin = x + 1;
+                    }
+                }
+            }
+
+            if (!cut.cleared.empty())
+            {
+                const auto row = &cut.cleared[static_cast<std::size_t>(y) * width];
+                int begin = 0;
+                for (int x = 0; x <= width; x++)
+                {
+                    if (x == width || !row[x])
+                    {
+                        clearRun(begin, x, y);
+                        begin = x + 1;
+                    }
+                }
+            }
+        }
+    }
+
+    // Calls function(y, begin, end) for every run of pixels the cut keeps on row y
+    template<typename Function>
+    void forEachKeptRun(const BlockCut& cut, Vector2i blockSize, const Function& function)
+    {
+        const int columnsHeight = *std::max_element(cut.columnEnds.begin(), cut.columnEnds.end());
+        for (int y = 0; y < blockSize.y; y++)
+        {
+            const int rowEnd = cut.rowEnds[y];
+            if (y >= columnsHeight && cut.cleared.empty())
+            {
+                if (rowEnd < blockSize.x)
+                {
+                    function(y, rowEnd, blockSize.x);
+                }
+                continue;
+            }
+
+            const std::uint8_t* clearedRow = cut.cleared.empty() ? nullptr : &cut.cleared[static_cast<std::size_t>(y) * blockSize.x];
+            int begin = rowEnd;
+            for (int x = rowEnd; x <= blockSize.x; x++)
+            {
+                if (x == blockSize.x || cut.columnEnds[x] > y || (clearedRow && clearedRow[x]))
+                {
+                    if (x > begin)
+                    {
+                        function(y, begin, x);
+                    }
+                    begin = x + 1;
+                }
+            }
+        }
+    }
+
+    // Squared distance transform of one line, the lower envelope of the parabolas (x - q)² + f[q] as in Felzenszwalb and Huttenlocher.
+    // Samples at or past `limit` can't bring anything under it and aren't added. `vertices` and `bounds` are scratch space for count
+    // and count + 1 values
+    void distanceTransformLine(const float* f, float* distances, int count, float limit, int* vertices, float* bounds)
+    {
+        const auto intersection = [&](int q, int v) { return ((f[q] + q * q) - (f[v] + v * v)) / (2.f * (q - v)); };
+
+        int k = -1;
+        for (int q = 0; q < count; q++)
+        {
+            if (f[q] >= limit)
+            {
+                continue;
+            }
+
+            float s = -std::numeric_limits<float>::infinity();
+            while (k >= 0 && (s = intersection(q, vertices[k])) <= bounds[k])
+            {
+                k--;
+            }
+
+            k++;
+            vertices[k] = q;
+            bounds[k] = k > 0 ? s : -std::numeric_limits<float>::infinity();
+            bounds[k + 1] = std::numeric_limits<float>::infinity();
+        }
+
+        if (k < 0)
+        {
+            std::fill_n(distances, count, limit);
+            return;
+        }
+
+        k = 0;
+        for (int q = 0; q < count; q++)
+        {
+            while (bounds[k + 1] < q)
+            {
+                k++;
+            }
+            distances[q] = std::min(static_cast<float>((q - vertices[k]) * (q - vertices[k])) + f[vertices[k]], limit);
+        }
+    }
+
+    // What featherImage builds for every block
+    struct FeatherScratch
+    {
+        std::vector<std::uint8_t> seeds;
+        std::array<std::vector<float>, 2> distances;
+        std::vector<float> line;
+        std::vector<int> vertices;
+        std::vector<float> bounds;
+        std::vector<float> keptAlphas;
+        std::vector<float> clearedAlphas;
+    };
+
+    // Squared Euclidean distance from every cell of a grid to its nearest seed, exact below reach² and capped at (reach + 1)².
+    // Columns are scanned down and up a whole row at a time, which vectorises, then every row takes the lower envelope of its parabolas
+    void seedDistances(const std::vector<std::uint8_t>& seeds, Vector2i size, int reach, FeatherScratch& scratch, std::vector<float>& distances)
+    {
+        const auto far = static_cast<float>(reach + 1);
+        distances.resize(seeds.size());
+
+        for (int y = 0; y < size.y; y++)
+        {
+            float* row = &distances[static_cast<std::size_t>(y) * size.x];
+            const std::uint8_t* rowSeeds = &seeds[static_cast<std::size_t>(y) * size.x];
+            const float* above = y > 0 ? row - size.x : nullptr;
+            for (int x = 0; x < size.x; x++)
+            {
+                row[x] = rowSeeds[x] ? 0.f : std::min(above ? above[x] + 1.f : far, far);
+            }
+        }
+
+        for (int y = size.y - 2; y >= 0; y--)
+        {
+            float* row = &distances[static_cast<std::size_t>(y) * size.x];
+            const float* below = row + size.x;
+            for (int x = 0; x < size.x; x++)
+            {
+                row[x] = std::min(row[x], below[x] + 1.f);
+            }
+        }
+
+        auto& line = scratch.line;
+        auto& vertices = scratch.vertices;
+        auto& bounds = scratch.bounds;
+        line.resize(size.x);
+        vertices.resize(size.x);
+        bounds.resize(size.x + 1);
+        for (int y = 0; y < size.y; y++)
+        {
+            float* row = &distances[static_cast<std::size_t>(y) * size.x];
+            for (int x = 0; x < size.x; x++)
+            {
+                line[x] = row[x] * row[x];
+            }
+            distanceTransformLine(line.data(), row, size.x, far * far, vertices.data(), bounds.data());
+        }
+    }
+
+    // Replaces the cut's hard edge by an alpha ramp `width` pixels wide centred on the seam pixels. Only the top and left strips,
+    // widened by half the ramp, come that close to the seam, and they're transformed separately: any seam pixel within reach of
+    // a pixel of one strip lies in the same strip, unless that pixel is in both
+    void featherImage(Image& image, const BlockCut& cut, Vector2i overlap, OverlapKind kind, int width, FeatherScratch& scratch)
+    {
+        const auto size = Vector2i(image.getSize());
+        const int reach = (width + 1) / 2;
+
+        const Vector2i topStrip{ kind != OverlapKind::Left ? size.x : 0, kind != OverlapKind::Left ? std::min(size.y, overlap.y + reach) : 0 };
+        const Vector2i leftStrip{ kind != OverlapKind::Top ? std::min(size.x, overlap.x + reach) : 0, kind != OverlapKind::Top ? size.y : 0 };
+
+        const auto transformStrip = [&](Vector2i strip, std::vector<float>& distances)
+        {
+            auto& seeds = scratch.seeds;
+            seeds.assign(static_cast<std::size_t>(strip.x) * strip.y, 0);
+            for (const auto pos : cut.seam)
+            {
+                if (pos.x < strip.x && pos.y < strip.y)
+                {
+                    seeds[pos.x + static_cast<std::size_t>(pos.y) * strip.x] = 1;
+                }
+            }
+            seedDistances(seeds, strip, reach, scratch, distances);
+        };
+
+        const auto& topDistances = scratch.distances[0];
+        const auto& leftDistances = scratch.distances[1];
+        transformStrip(topStrip, scratch.distances[0]);
+        transformStrip(leftStrip, scratch.distances[1]);
+
+        // Squared distances are whole numbers up to (reach + 1)², so the ramp is looked up rather than computed per pixel
+        const int far = (reach + 1) * (reach + 1);
+        auto& keptAlphas = scratch.keptAlphas;
+        auto& clearedAlphas = scratch.clearedAlphas;
+        keptAlphas.resize(far + 1);
+        clearedAlphas.resize(far + 1);
+        for (int distance = 0; distance <= far; distance++)
+        {
+            const float offset = std::sqrt(static_cast<float>(distance)) / static_cast<float>(width);
+            keptAlphas[distance] = std::min(0.5f + offset, 1.f);
+            clearedAlphas[distance] = std::max(0.5f - offset, 0.f);
+        }
+
+        std::uint8_t* pixels = image.getPixelsPtr();
+
+        // Pixels of both strips take the nearer of their two distances
+        for (int y = 0; y < std::max(topStrip.y, leftStrip.y); y++)
+        {
+            const float* topRow = y < topStrip.y ? &topDistances[static_cast<std::size_t>(y) * topStrip.x] : nullptr;
+            const float* leftRow = leftStrip.x > 0 ? &leftDistances[static_cast<std::size_t>(y) * leftStrip.x] : nullptr;
+            const std::uint8_t* clearedRow = cut.cleared.empty() ? nullptr : &cut.cleared[static_cast<std::size_t>(y) * size.x];
+            const int rowEnd = cut.rowEnds[y];
+            std::uint8_t* row = &pixels[static_cast<std::size_t>(y) * size.x * 4];
+
+            for (int x = 0; x < (topRow ? topStrip.x : leftStrip.x); x++)
+            {
+                float distance = topRow ? topRow[x] : static_cast<float>(far);
+                if (x < leftStrip.x)
+                {
+                    distance = std::min(distance, leftRow[x]);
+                }
+
+                const bool isCleared = x < rowEnd || y < cut.columnEnds[x] || (clearedRow && clearedRow[x]);
+                const float alpha = (isCleared ? clearedAlphas : keptAlphas)[static_cast<int>(distance)];
+                row[x * 4 + 3] = static_cast<std::uint8_t>(row[x * 4 + 3] * alpha + 0.5f);
+            }
+        }
+    }
+
+    // One grid of the multigrid hierarchy. Pixels are cells tied to the neighbours they have inside the grid, so borders are free
+    struct PoissonLevel
+    {
+        explicit PoissonLevel(Vector2i size)
+            : size(size), solution(static_cast<std::size_t>(size.x) * size.y), rhs(solution.size())
+        {
+        }
+
+        Vector2i size;
+        std::vector<float> solution;
+        std::vector<float> rhs;
+    };
+
+    template<typename Function>
+    void parallelRows(ThreadPool& threadPool, int rowCount, const Function& function)
+    {
+        const int bandCount = std::min(threadPool.getThreadCount(), rowCount);
+        threadPool.parallelFor(bandCount, [&](int band)
+        {
+            const int end = (band + 1) * rowCount / bandCount;
+            for (int y = band * rowCount / bandCount; y < end; y++)
+            {
+                function(y);
+            }
+        });
+    }
+
+    // One Gauss-Seidel update of sum_q (c_p - c_q) = rhs_p on every other cell of a row, starting at column `first`
+    void smoothPoissonRow(PoissonLevel& level, int y, int first)
+    {
+        const auto [width, height] = level.size;
+        const auto offset = static_cast<std::size_t>(y) * width;
+        float* row = &level.solution[offset];
+        const float* rhs = &level.rhs[offset];
+
+        // Missing rows are replaced by the row itself with a zero weight, which keeps the inner loop free of branches
+        const float aboveWeight = y > 0 ? 1.f : 0.f;
+        const float belowWeight = y + 1 < height ? 1.f : 0.f;
+        const float* above = y > 0 ? row - width : row;
+        const float* below = y + 1 < height ? row + width : row;
+
+        const auto update = [&](int x, float horizontalSum, float inverseCount)
+        {
+            row[x] = (rhs[x] + aboveWeight * above[x] + belowWeight * below[x] + horizontalSum) * inverseCount;
+        };
+
+        // Cells with no neighbour at all only exist on a 1x1 grid and keep their value
+        const float verticalCount = aboveWeight + belowWeight;
+        const auto inverse = [](float count) { return count > 0 ? 1.f / count : 0.f; };
+        const float inverseInner = inverse(verticalCount + 2.f);
+
+        int x = first;
+        if (x == 0)
+        {
+            if (width > 1 || verticalCount > 0)
+            {
+                update(0, width > 1 ? row[1] : 0.f, inverse(verticalCount + (width > 1 ? 1.f : 0.f)));
+            }
+            x = 2;
+        }
+
+        for (; x < width - 1; x += 2)
+        {
+            update(x, row[x - 1] + row[x + 1], inverseInner);
+        }
+
+        if (x == width - 1)
+        {
+            update(x, row[x - 1], inverse(verticalCount + 1.f));
+        }
+    }
+
+    // Red-black Gauss-Seidel, red cells being those with x + y even. Cells only read cells of the other colour, so a band of rows can
+    // update the red cells of row y and then the black cells of row y - 1 in a single pass over memory. The black cells on a band's
+    // first and last rows need the neighbouring bands' red cells and are left for after the pass
+    void smoothPoisson(PoissonLevel& level, int iterations, ThreadPool& threadPool)
+    {
+        const int height = level.size.y;
+        const int bandCount = std::min(threadPool.getThreadCount(), height);
+        const auto bandBegin = [&](int band) { return band * height / bandCount; };
+
+        for (int iteration = 0; iteration < iterations; iteration++)
+        {
+            threadPool.parallelFor(bandCount, [&](int band)
+            {
+                const int begin = bandBegin(band);
+                const int end = bandBegin(band + 1);
+                for (int y = begin; y < end; y++)
+                {
+                    smoothPoissonRow(level, y, y & 1);
+                    if (y - 1 > begin)
+                    {
+                        smoothPoissonRow(level, y - 1, y & 1);
+                    }
+                }
+            });
+
+            for (int band = 0; band < bandCount; band++)
+            {
+                const int begin = bandBegin(band);
+                const int end = bandBegin(band + 1);
+                smoothPoissonRow(level, begin, (begin + 1) & 1);
+                if (end - 1 > begin)
+                {
+                    smoothPoissonRow(level, end - 1, end & 1);
+                }
+            }
+        }
+    }
+
+    // Coarse cells cover 2x2 fine cells and get the sum of their residuals rhs - Lc, that matches the unscaled Laplacian growing 4x
+    // per level for the same smooth error. Residuals are summed as they're computed so the fine level never stores them
+    void restrictPoisson(const PoissonLevel& fine, PoissonLevel& coarse, ThreadPool& threadPool)
+    {
+        const auto [width, height] = fine.size;
+        parallelRows(threadPool, coarse.size.y, [&](int y)
+        {
+            const auto offset = static_cast<std::size_t>(y) * coarse.size.x;
+            std::fill_n(&coarse.solution[offset], coarse.size.x, 0.f);
+            float* sums = &coarse.rhs[offset];
+            std::fill_n(sums, coarse.size.x, 0.f);
+
+            for (int fineY = 2 * y; fineY < std::min(2 * y + 2, height); fineY++)
+            {
+                const auto fineOffset = static_cast<std::size_t>(fineY) * width;
+                const float* row = &fine.solution[fineOffset];
+                const float* rhs = &fine.rhs[fineOffset];
+
+                const float aboveWeight = fineY > 0 ? 1.f : 0.f;
+                const float belowWeight = fineY + 1 < height ? 1.f : 0.f;
+                const float* above = fineY > 0 ? row - width : row;
+                const float* below = fineY + 1 < height ? row + width : row;
+
+                const auto residual = [&](int x)
+                {
+                    const float vertical = aboveWeight * (row[x] - above[x]) + belowWeight * (row[x] - below[x]);
+                    return rhs[x] - vertical - (x > 0 ? row[x] - row[x - 1] : 0.f) - (x + 1 < width ? row[x] - row[x + 1] : 0.f);
+                };
+
+                // Both cells of a pair have two horizontal neighbours everywhere but in the first and last pairs
+                const int innerEnd = (width - 1) / 2;
+                for (int x = 0; x < std::min(2, width); x++)
+                {
+                    sums[0] += residual(x);
+                }
+
+                for (int coarseX = 1; coarseX < innerEnd; coarseX++)
+                {
+                    // The edge between the two cells cancels out of their sum
+                    const int x = 2 * coarseX;
+                    const float pair = row[x] + row[x + 1];
+                    const float vertical = aboveWeight * (pair - above[x] - above[x + 1]) + belowWeight * (pair - below[x] - below[x + 1]);
+                    const float horizontal = (row[x] - row[x - 1]) + (row[x + 1] - row[x + 2]);
+                    sums[coarseX] += rhs[x] + rhs[x + 1] - vertical - horizontal;
+                }
+
+                for (int x = std::max(2, 2 * innerEnd); x < width; x++)
+                {
+                    sums[x / 2] += residual(x);
+                }
+            }
+        });
+    }
+
+    // Bilinear between coarse cell centres, each fine cell takes 3/4 of its own coarse cell and 1/4 of the nearest other one per axis
+    void prolongatePoisson(const PoissonLevel& coarse, PoissonLevel& fine, ThreadPool& threadPool)
+    {
+        parallelRows(threadPool, fine.size.y, [&](int y)
+        {
+            const int coarseY = y / 2;
+            const int otherY = std::clamp(y & 1 ? coarseY + 1 : coarseY - 1, 0, coarse.size.y - 1);
+            const float* near = &coarse.solution[static_cast<std::size_t>(coarseY) * coarse.size.x];
+            const float* far = &coarse.solution[static_cast<std::size_t>(otherY) * coarse.size.x];
+            float* row = &fine.solution[static_cast<std::size_t>(y) * fine.size.x];
+
+            const auto column = [&](int coarseX) { return 0.75f * near[coarseX] + 0.25f * far[coarseX]; };
+            const auto prolongate = [&](int x)
+            {
+                const int coarseX = x / 2;
+                const int otherX = std::clamp(x & 1 ? coarseX + 1 : coarseX - 1, 0, coarse.size.x - 1);
+                row[x] += 0.75f * column(coarseX) + 0.25f * column(otherX);
+            };
+
+            // Away from the first and last coarse columns neither neighbour needs clamping
+            const int innerEnd = std::min(coarse.size.x - 1, fine.size.x / 2);
+            prolongate(0);
+            if (fine.size.x > 1)
+            {
+                prolongate(1);
+            }
+
+            for (int coarseX = 1; coarseX < innerEnd; coarseX++)
+            {
+                const float left = column(coarseX - 1);
+                const float centre = column(coarseX);
+                const float right = column(coarseX + 1);
+                row[2 * coarseX] += 0.75f * centre + 0.25f * left;
+                row[2 * coarseX + 1] += 0.75f * centre + 0.25f * right;
+            }
+
+            for (int x = std::max(2, 2 * innerEnd); x < fine.size.x; x++)
+            {
+                prolongate(x);
+            }
+        });
+    }
+
+    void solvePoissonCycle(std::vector<PoissonLevel>& levels, std::size_t index, ThreadPool& threadPool)
+    {
+        auto& level = levels[index];
+        if (index + 1 == levels.size())
+        {
+            smoothPoisson(level, 16, threadPool);
+            return;
+        }
+
+        smoothPoisson(level, 2, threadPool);
+        restrictPoisson(level, levels[index + 1], threadPool);
+        solvePoissonCycle(levels, index + 1, threadPool);
+        prolongatePoisson(levels[index + 1], level, threadPool);
+        smoothPoisson(level, 2, threadPool);
+    }
+
+    // Gradient domain blending over the whole quilt. The correction c added to it minimises the sum over touching pixels p, q of
+    // (c_p - c_q - t_pq)², where t_pq is 0 inside a block and across a seam replaces the quilt's jump by the mean of the gradients
+    // just before and after it. That's the Poisson equation sum_q (c_p - c_q) = sum_q t_pq, solved per channel with multigrid V-cycles
+    void blendSeamsPoisson(Canvas& canvas, const std::vector<int>& blockIds, ThreadPool& threadPool)
+    {
+        const auto size = Vector2i(canvas.getSize());
+        const auto pixelCount = static_cast<std::size_t>(size.x) * size.y;
+
+        std::vector<PoissonLevel> levels;
+        levels.emplace_back(size);
+        while (levels.back().size.x > 2 || levels.back().size.y > 2)
+        {
+            levels.emplace_back((levels.back().size + Vector2i(1, 1)) / 2);
+        }
+
+        std::vector<std::uint8_t> blended(pixelCount * 4);
+        const auto view = canvas.getView();
+        const auto rowSize = static_cast<std::size_t>(size.x) * 4;
+        for (int y = 0; y < size.y; y++)
+        {
+            std::memcpy(&blended[y * rowSize], view.row(y), rowSize);
+        }
+
+        auto& fine = levels.front();
+        for (int channel = 0; channel < 3; channel++)
+        {
+            const auto value = [&](int x, int y)
+            {
+                return static_cast<float>(view.row(y, x)[channel]);
+            };
+
+            const auto sameBlock = [&](Vector2i a, Vector2i b)
+            {
+                return b.x >= 0 && b.y >= 0 && b.x < size.x && b.y < size.y && blockIds[a.x + a.y * size.x] == blockIds[b.x + b.y * size.x];
+            };
+
+            // Gathering every pixel's own edges keeps rows independent, t_qp comes out as -t_pq
+            parallelRows(threadPool, size.y, [&](int y)
+            {
+                const int* ids = &blockIds[static_cast<std::size_t>(y) * size.x];
+                float* rhsRow = &fine.rhs[static_cast<std::size_t>(y) * size.x];
+                for (int x = 0; x < size.x; x++)
+                {
+                    const int id = ids[x];
+                    if ((x == 0 || ids[x - 1] == id) && (x + 1 == size.x || ids[x + 1] == id) &&
+                        (y == 0 || ids[x - size.x] == id) && (y + 1 == size.y || ids[x + size.x] == id))
+                    {
+                        rhsRow[x] = 0.f;
+                        continue;
+                    }
+
+                    const Vector2i p{ x, y };
+                    float rhs = 0.f;
+                    for (const auto d : { Vector2i(1, 0), Vector2i(-1, 0), Vector2i(0, 1), Vector2i(0, -1) })
+                    {
+                        const auto q = p + d;
+                        if (q.x < 0 || q.y < 0 || q.x >= size.x || q.y >= size.y || sameBlock(p, q))
+                        {
+                            continue;
+                        }
+
+                        float gradient = 0.f;
+                        int gradientCount = 0;
+                        if (sameBlock(p, p - d))
+                        {
+                            gradient += value(p.x - d.x, p.y - d.y) - value(p.x, p.y);
+                            gradientCount++;
+                        }
+                        if (sameBlock(q, q + d))
+                        {
+                            gradient += value(q.x, q.y) - value(q.x + d.x, q.y + d.y);
+                            gradientCount++;
+                        }
+                        if (gradientCount > 0)
+                        {
+                            gradient /= gradientCount;
+                        }
+
+                        rhs += gradient - (value(p.x, p.y) - value(q.x, q.y));
+                    }
+
+                    rhsRow[x] = rhs;
+                }
+            });
+
+            std::fill(fine.solution.begin(), fine.solution.end(), 0.f);
+            for (int cycle = 0; cycle < 2; cycle++)
+            {
+                solvePoissonCycle(levels, 0, threadPool);
+            }
+
+            // Free borders only fix c up to a constant, keeping its mean at zero keeps the quilt's average colour
+            std::vector<double> rowSums(size.y);
+            parallelRows(threadPool, size.y, [&](int y)
+            {
+                const float* row = &fine.solution[static_cast<std::size_t>(y) * size.x];
+                rowSums[y] = std::accumulate(row, row + size.x, 0.0);
+            });
+            const float offset = 0.5f - static_cast<float>(std::accumulate(rowSums.begin(), rowSums.end(), 0.0) / static_cast<double>(pixelCount));
+
+            parallelRows(threadPool, size.y, [&](int y)
+            {
+                const std::uint8_t* pixels = view.row(y);
+                const auto first = static_cast<std::size_t>(y) * size.x;
+                for (int x = 0; x < size.x; x++)
+                {
+                    const float corrected = pixels[x * 4 + channel] + fine.solution[first + x] + offset;
+                    blended[(first + x) * 4 + channel] = static_cast<std::uint8_t>(std::clamp(corrected, 0.f, 255.f));
+                }
+            });
+        }
+
+        canvas.assign(blended.data());
+    }
+
+    template<typename RndEngine>
+    Vector2i selectRandomBlock(RndEngine& rngEngine, const ImageRef& srcImage, Vector2i blockSize)
+    {
+        std::uniform_int_distribution<int> srcDistX(0, srcImage.getSize().x - blockSize.x);
+        std::uniform_int_distribution<int> srcDistY(0, srcImage.getSize().y - blockSize.y);
+        return { srcDistX(rngEngine), srcDistY(rngEngine) };
+    }
+
+    // Keeps the `capacity` lowest (error, index) pairs pushed into it in a max heap, so the
+    // worst kept candidate is always at hand and ties go to the lowest index
+    class TopCandidates
+    {
+    public:
+        struct Candidate
+        {
+            std::uint32_t error;
+            int index;
+
+            bool operator<(const Candidate& other) const
+            {
+                return std::tie(error, index) < std::tie(other.error, other.index);
+            }
+        };
+
+        explicit TopCandidates(int capacity = 0) : capacity(capacity)
+        {
+        }
+
+        // Empties the candidates but keeps their storage
+        void reset(int capacity)
+        {
+            this->capacity = capacity;
+            heap.clear();
+        }
+
+        // Errors at or above this can't get in, as long as candidates are pushed in increasing index order
+        std::uint32_t bound() const
+        {
+            return static_cast<int>(heap.size()) < capacity ? std::numeric_limits<std::uint32_t>::max() : heap.front().error;
+        }
+
+        void push(std::uint32_t error, int index)
+        {
+            const Candidate candidate{ error, index };
+            if (static_cast<int>(heap.size()) < capacity)
+            {
+                heap.push_back(candidate);
+                std::push_heap(heap.begin(), heap.end());
+            }
+            else if (candidate < heap.front())
+            {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = candidate;
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        const std::vector<Candidate>& getCandidates() const
+        {
+            return heap;
+        }
+
+    private:
+        int capacity;
+        std::vector<Candidate> heap;
+    };
+
+    // Number of best candidates weightedSelection draws from
+    int selectionCount(int candidateCount, float selectionSpan)
+    {
+        return std::min(static_cast<int>(candidateCount * selectionSpan), candidateCount - 1) + 1;
+    }
+
+    // Picks one of the selectionCount best candidates uniformly, the candidates can be spread over several
+    // TopCandidates (one per band of a parallel scan), since ties are broken by index the result doesn't depend on the split.
+    // `candidates` is where the bands are gathered
+    template<typename RndEngine>
+    int weightedSelection(RndEngine& rngEngine, const std::vector<TopCandidates>& bands, int candidateCount, float selectionSpan, std::vector<TopCandidates::Candidate>& candidates)
+    {
+        std::uniform_int_distribution<int> selectionDistribution(0, selectionCount(candidateCount, selectionSpan) - 1);
+        const auto rank = selectionDistribution(rngEngine);
+
+        candidates.clear();
+        for (const auto& band : bands)
+        {
+            candidates.insert(candidates.end(), band.getCandidates().begin(), band.getCandidates().end());
+        }
+
+        std::nth_element(candidates.begin(), candidates.begin() + rank, candidates.end());
+        return candidates[rank].index;
+    }
+
+    // `bands` and `candidates` are where the best are kept and gathered
+    template<typename RndEngine>
+    Vector2i weightedSelection(RndEngine& rngEngine, const std::uint32_t* data, Vector2i area, float selectionSpan,
+        std::vector<TopCandidates>& bands, std::vector<TopCandidates::Candidate>& candidates)
+    {
+        const auto count = area.x * area.y;
+
+        bands.resize(1);
+        bands[0].reset(selectionCount(count, selectionSpan));
+        for (int x = 0; x < count; x++)
+        {
+            bands[0].push(data[x], x);
+        }
+
+        const auto selectionIndex = weightedSelection(rngEngine, bands, count, selectionSpan, candidates);
+        return { selectionIndex % area.x, selectionIndex / area.x };
+    }
+
+    template<typename RndEngine>
+    Vector2i weightedSelection(RndEngine& rngEngine, const std::uint32_t* data, Vector2i area, float selectionSpan)
+    {
+        std::vector<TopCandidates> bands;
+        std::vector<TopCandidates::Candidate> candidates;
+        return weightedSelection(rngEngine, data, area, selectionSpan, bands, candidates);
+    }
+
+#if !defined(QUILTIS_NO_GPU)
+    sf::Vector2i toSf(Vector2i vector)
+    {
+        return { vector.x, vector.y };
+    }
+
+    sf::Shader& getBlockSelectionShader()
+    {
+        static constexpr std::string_view vertSrc = R"===(
+void main()
+{
+    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+    gl_TexCoord[0] = gl_MultiTexCoord0;
+    gl_FrontColor = gl_Color;
+}
+)===";
+
+        static constexpr std::string_view  fragSrc = R"===(
+#version 130
+
+uniform ivec2 srcSize;
+uniform sampler2D srcTexture;
+
+uniform ivec2 blockSize;
+uniform sampler2D blockTexture;
+
+uniform ivec2 topOverlap;
+uniform ivec2 leftOverlap;
+uniform int corse;
+
+void main()
+{
+    vec2 blockPos = gl_TexCoord[0].xy;
+    
+    float count = float(topOverlap.x * topOverlap.y + leftOverlap.x * leftOverlap.y - topOverlap.y * leftOverlap.x);
+    float error = 0.f;
+
+    for(int y = 0; y < topOverlap.y; y += corse)
+    {
+        for(int x = 0; x < topOverlap.x; x += corse)
+        {
+            vec2 offset = vec2(x + 0.5, y + 0.5);
+            vec4 blockPixel = texture2D(blockTexture, offset / blockSize);
+            vec4 srcPixel = texture2D(srcTexture, (blockPos + offset) / srcSize);
+            float diff = length(blockPixel - srcPixel);
+            error += diff;
+        }
+    }
+
+    for(int y = topOverlap.y; y < leftOverlap.y; y += corse)
+    {
+        for(int x = 0; x < leftOverlap.x; x += corse)
+        {
+            vec2 offset = vec2(x + 0.5, y + 0.5);
+            vec4 blockPixel = texture2D(blockTexture, offset / blockSize);
+            vec4 srcPixel = texture2D(srcTexture, (blockPos + offset) / srcSize);
+            float diff = length(blockPixel - srcPixel);            
+            error += diff;
+        }
+    }
+
+    error /= count;
+
+    uint data = uint(error * 255);
+    gl_FragColor = vec4(
+        float((data >> uint(24)) & uint(0xFF)) / 255.f,
+        float((data >> uint(16)) & uint(0xFF)) / 255.f,
+        float((data >> uint(8)) & uint(0xFF)) / 255.f,
+        float((data >> uint(0)) & uint(0xFF)) / 255.f
+    );
+}
+)===";
+
+        static sf::Shader shader(vertSrc, fragSrc);
+        return shader;
+    }
+
+    template<typename RndEngine>
+    Vector2i selectBestBlockGpu(const WeightedBlockSelection& settings, RndEngine& rngEngine, const sf::Texture& srcTexture, const Canvas& canvas, Vector2i blockSize, Vector2i blockPos, Vector2i overlap)
+    {
+        const auto area = sf::Vector2i(srcTexture.getSize()) - toSf(blockSize);
+        std::vector<float> blockErrors(area.x * area.y);
+        sf::RenderTexture target{ sf::Vector2u(area) };
+
+        sf::Vector2i topOverlap(blockSize.x, overlap.y);
+        sf::Vector2i leftOverlap(overlap.x, blockSize.y);
+
+        if (blockPos.x == 0)
+        {
+            leftOverlap = {};
+        }
+
+        if (blockPos.y == 0)
+        {
+            topOverlap = {};
+        }
+
+        const auto blockImage = canvas.copyRegion({ blockPos, blockSize });
+        sf::Texture blockTexture(sf::Vector2u(toSf(blockSize)));
+        blockTexture.update(blockImage.getPixelsPtr());
+        blockTexture.setSmooth(0);
+
+        auto& shader = getBlockSelectionShader();
+
+        sf::RenderStates renderStates{};
+        renderStates.shader = &shader;
+        renderStates.coordinateType = sf::CoordinateType::Pixels;
+        renderStates.blendMode = sf::BlendNone;
+
+        shader.setUniform("srcTexture", srcTexture);
+        shader.setUniform("srcSize", sf::Vector2i(srcTexture.getSize()));
+        shader.setUniform("blockTexture", blockTexture);
+        shader.setUniform("blockSize", toSf(blockSize));
+        shader.setUniform("overlap", toSf(overlap));
+        shader.setUniform("topOverlap", topOverlap);
+        shader.setUniform("leftOverlap", leftOverlap);
+        shader.setUniform("corse", settings.searchStride);
+
+        sf::RectangleShape shape{ sf::Vector2f(area) };
+        shape.setTextureRect({ {}, area });
+
+        target.draw(shape, renderStates);
+        target.display();
+
+        const auto result = target.getTexture().copyToImage();
+
+        std::uint32_t minError = std::numeric_limits<std::int32_t>::max();
+        std::uint32_t minIndex{};
+
+        const auto count = result.getSize().x * result.getSize().y;
+
+        auto ptr = (std::uint32_t*)result.getPixelsPtr();
+
+        return weightedSelection(rngEngine, ptr, Vector2i(area.x, area.y), settings.selectionSpan);
+    }
+#endif
+
+    // Whether blocks are selected with OpenGL, only the weighted selection has a GPU path and builds without it always select on the CPU
+    bool usesGpu([[maybe_unused]] const Settings& settings)
+    {
+#if defined(QUILTIS_NO_GPU)
+        return false;
+#else
+        return settings.useGpuAcceleration && std::holds_alternative<WeightedBlockSelection>(settings.blockSelection);
+#endif
+    }
+
+    // Settings written before seamBlending existed ask for averaging through blendSeams
+    SeamBlending getSeamBlending(const Settings& settings)
+    {
+        return settings.seamBlending == SeamBlending::None && settings.blendSeams ? SeamBlending::Average : settings.seamBlending;
+    }
+
+    // Read only mapping of a whole file, empty when the file can't be opened
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::filesystem::path& path)
+        {
+#ifdef _WIN32
+            file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                return;
+            }
+
+            LARGE_INTEGER fileSize{};
+            if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+            {
+                return;
+            }
+
+            mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+            {
+                data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                size = data ? static_cast<std::size_t>(fileSize.QuadPart) : 0;
+            }
+#else
+            const int descriptor = open(path.c_str(), O_RDONLY);
+            if (descriptor < 0)
+            {
+                return;
+            }
+
+            struct stat status{};
+            if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+            {
+                const auto address = mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+                if (address != MAP_FAILED)
+                {
+                    data = address;
+                    size = static_cast<std::size_t>(status.st_size);
+                }
+            }
+
+            // The mapping keeps the file alive on its own
+            close(descriptor);
+#endif
+        }
+
+        ~MappedFile()
+        {
+#ifdef _WIN32
+            if (data)
+            {
+                UnmapViewOfFile(data);
+            }
+            if (mapping)
+            {
+                CloseHandle(mapping);
+            }
+            if (file != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(file);
+            }
+#else
+            if (data)
+            {
+                munmap(data, size);
+            }
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const std::byte* getData() const
+        {
+            return static_cast<const std::byte*>(data);
+        }
+
+        std::size_t getSize() const
+        {
+            return size;
+        }
+
+    private:
+        void* data{};
+        std::size_t size{};
+
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping{};
+#endif
+    };
+
+    // 64 bit digests of some bytes, one per seed, taken in a single pass over them. Different seeds give independent digests
+    template<std::size_t N>
+    std::array<std::uint64_t, N> digestBytes(std::span<const std::byte> bytes, const std::array<std::uint64_t, N>& seeds)
+    {
+        constexpr std::uint64_t prime1 = 0x9e3779b185ebca87;
+        constexpr std::uint64_t prime2 = 0xc2b2ae3d27d4eb4f;
+
+        const auto data = reinterpret_cast<const unsigned char*>(bytes.data());
+        const auto round = [&](std::uint64_t hash, std::uint64_t word) { return std::rotl(hash ^ (word * prime2), 31) * prime1; };
+
+        std::array<std::uint64_t, N> hashes;
+        for (std::size_t i = 0; i < N; i++)
+        {
+            hashes[i] = (seeds[i] ^ bytes.size()) * prime1 + prime2;
+        }
+
+        std::size_t x = 0;
+        for (; x + 8 <= bytes.size(); x += 8)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, data + x, sizeof(word));
+            for (auto& hash : hashes)
+            {
+                hash = round(hash, word);
+            }
+        }
+
+        std::uint64_t tail = 0;
+        std::memcpy(&tail, data + x, bytes.size() - x);
+        for (auto& hash : hashes)
+        {
+            hash = round(hash, tail);
+
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccd;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53;
+            hash ^= hash >> 33;
+        }
+        return hashes;
+    }
+
+    std::uint64_t digestBytes(std::span<const std::byte> bytes, std::uint64_t seed)
+    {
+        return digestBytes<1>(bytes, { seed })[0];
+    }
+
+    // Tells sources apart for the cache, 128 bits so a collision between two sources isn't a concern
+    using ImageDigest = std::array<std::uint64_t, 2>;
+
+    ImageDigest digestImage(const ImageRef& image)
+    {
+        const auto size = image.getSize();
+        const auto bytes = std::as_bytes(std::span(image.getPixelsPtr(), static_cast<std::size_t>(size.x) * size.y * 4));
+        const auto sizeSeed = size.x | static_cast<std::uint64_t>(size.y) << 32;
+        return digestBytes<2>(bytes, { sizeSeed, ~sizeSeed });
+    }
+
+    // Cache files are a header followed by sections of plain arrays, each aligned so they can be used straight from the mapping.
+    // They're written in native byte order and layout, the version has to change whenever a cached structure does.
+    // The header names the source the file was made from, checksums every section and then itself. Opening a file only checks
+    // the header since reading every section would cost about as much as building some of them, QUILTIS_VERIFY_CACHE checks them all
+    struct CacheHeader
+    {
+        static constexpr std::uint32_t currentVersion = 3;
+        static constexpr int maxSectionCount = 8;
+        static constexpr std::size_t sectionAlignment = 64;
+        static constexpr std::uint64_t checksumSeed = 0x51554c54;
+
+        std::array<char, 4> magic{ 'Q', 'L', 'T', 'C' };
+        std::uint32_t version = currentVersion;
+        std::uint32_t sectionCount{};
+        std::uint32_t reserved{};
+        ImageDigest source{};
+        std::array<std::uint64_t, maxSectionCount> offsets{};
+        std::array<std::uint64_t, maxSectionCount> sizes{};
+        std::array<std::uint64_t, maxSectionCount> checksums{};
+        // Of the header up to here
+        std::uint64_t headerChecksum{};
+
+        std::uint64_t computeHeaderChecksum() const
+        {
+            return digestBytes(std::as_bytes(std::span(reinterpret_cast<const char*>(this), offsetof(CacheHeader, headerChecksum))), checksumSeed);
+        }
+    };
+
+    class CacheWriter
+    {
+    public:
+        // Only the view is kept, the values have to outlive the call to save
+        template<typename T>
+        void addSection(std::span<const T> values)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            sections.push_back(std::as_bytes(values));
+        }
+
+        // Goes through a temporary file so a reader never maps a partial one, failing is fine since the cache is optional
+        void save(const std::filesystem::path& path, const ImageDigest& source) const
+        {
+            const auto align = [](std::uint64_t offset) { return (offset + CacheHeader::sectionAlignment - 1) / CacheHeader::sectionAlignment * CacheHeader::sectionAlignment; };
+
+            CacheHeader header;
+            header.sectionCount = static_cast<std::uint32_t>(sections.size());
+            header.source = source;
+
+            std::uint64_t offset = align(sizeof(CacheHeader));
+            for (std::size_t x = 0; x < sections.size(); x++)
+            {
+                header.offsets[x] = offset;
+                header.sizes[x] = sections[x].size();
+                header.checksums[x] = digestBytes(sections[x], CacheHeader::checksumSeed);
+                offset = align(offset + sections[x].size());
+            }
+            header.headerChecksum = header.computeHeaderChecksum();
+
+            std::error_code error;
+            std::filesystem::create_directories(path.parent_path(), error);
+
+            auto temporaryPath = path;
+            temporaryPath += ".tmp" + std::to_string(std::random_device{}());
+
+            bool written = false;
+            {
+                std::ofstream file(temporaryPath, std::ios::binary);
+
+                const std::array<char, CacheHeader::sectionAlignment> padding{};
+                std::uint64_t position = 0;
+                const auto write = [&](const void* data, std::uint64_t size)
+                {
+                    file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+                    position += size;
+                };
+
+                write(&header, sizeof(header));
+                for (std::size_t x = 0; x < sections.size(); x++)
+                {
+                    write(padding.data(), header.offsets[x] - position);
+                    write(sections[x].data(), sections[x].size());
+                }
+
+                written = file.good();
+            }
+
+            if (written)
+            {
+                std::filesystem::rename(temporaryPath, path, error);
+            }
+
+            if (!written || error)
+            {
+                std::filesystem::remove(temporaryPath, error);
+            }
+        }
+
+    private:
+        std::vector<std::span<const std::byte>> sections;
+    };
+
+    // A mapped cache file, whatever is loaded from it keeps it alive and views its sections in place
+    class CacheFile
+    {
+    public:
+        explicit CacheFile(const std::filesystem::path& path) : file(path)
+        {
+        }
+
+        // A stale file, or one whose header is damaged or doesn't fit the file, is rebuilt rather than trusted
+        bool isValid(const ImageDigest& source) const
+        {
+            if (file.getSize() < sizeof(CacheHeader))
+            {
+                return false;
+            }
+
+            const auto header = getHeader();
+            if (header.magic != CacheHeader{}.magic || header.version != CacheHeader::currentVersion || header.sectionCount > CacheHeader::maxSectionCount ||
+                header.source != source || header.headerChecksum != header.computeHeaderChecksum())
+            {
+                return false;
+            }
+
+            for (std::uint32_t x = 0; x < header.sectionCount; x++)
+            {
+                if (header.offsets[x] % CacheHeader::sectionAlignment != 0 || header.offsets[x] > file.getSize() || header.sizes[x] > file.getSize() - header.offsets[x])
+                {
+                    return false;
+                }
+
+#if defined(QUILTIS_VERIFY_CACHE)
+                const auto section = std::as_bytes(std::span(file.getData() + header.offsets[x], header.sizes[x]));
+                if (digestBytes(section, CacheHeader::checksumSeed) != header.checksums[x])
+                {
+                    return false;
+                }
+#endif
+            }
+
+            return true;
+        }
+
+        template<typename T>
+        std::optional<std::span<const T>> getSection(int index, std::size_t count) const
+        {
+            static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= CacheHeader::sectionAlignment);
+
+            const auto header = getHeader();
+            if (index >= static_cast<int>(header.sectionCount) || header.sizes[index] != count * sizeof(T))
+            {
+                return std::nullopt;
+            }
+
+            return std::span<const T>(reinterpret_cast<const T*>(file.getData() + header.offsets[index]), count);
+        }
+
+        // Number of T a section holds, for the sections whose size isn't known up front
+        template<typename T>
+        std::size_t getSectionCount(int index) const
+        {
+            const auto header = getHeader();
+            return index < static_cast<int>(header.sectionCount) ? header.sizes[index] / sizeof(T) : 0;
+        }
+
+    private:
+        CacheHeader getHeader() const
+        {
+            CacheHeader header;
+            std::memcpy(&header, file.getData(), sizeof(header));
+            return header;
+        }
+
+        MappedFile file;
+    };
+
+    // Summed-area tables of the source channels and of their summed squares, interleaved so a box lookup touches 4 cache lines
+    struct IntegralTables
+    {
+        struct Entry
+        {
+            std::array<std::uint64_t, 3> sums{};
+            std::uint64_t squares{};
+        };
+
+        explicit IntegralTables(const ImageRef& srcImage) : size(Vector2i(srcImage.getSize()) + Vector2i(1, 1))
+        {
+            storage.resize(static_cast<std::size_t>(size.x) * size.y);
+
+            const auto srcPtr = (const Color*)srcImage.getPixelsPtr();
+            for (int y = 1; y < size.y; y++)
+            {
+                Entry row{};
+                for (int x = 1; x < size.x; x++)
+                {
+                    const auto color = srcPtr[(x - 1) + (y - 1) * (size.x - 1)];
+                    const std::uint64_t values[3] = { color.r, color.g, color.b };
+
+                    const auto index = x + static_cast<std::size_t>(y) * size.x;
+                    const auto& above = storage[index - size.x];
+                    auto& entry = storage[index];
+
+                    row.squares += values[0] * values[0] + values[1] * values[1] + values[2] * values[2];
+                    entry.squares = above.squares + row.squares;
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        row.sums[c] += values[c];
+                        entry.sums[c] = above.sums[c] + row.sums[c];
+                    }
+                }
+            }
+
+            entries = storage;
+        }
+
+        IntegralTables(IntegralTables&&) = default;
+        IntegralTables& operator=(IntegralTables&&) = default;
+
+        // Uses the tables in place from the mapped file
+        static std::optional<IntegralTables> load(Vector2u imageSize, std::shared_ptr<const CacheFile> cache)
+        {
+            const auto size = Vector2i(imageSize) + Vector2i(1, 1);
+            const auto entries = cache->getSection<Entry>(0, static_cast<std::size_t>(size.x) * size.y);
+            if (!entries)
+            {
+                return std::nullopt;
+            }
+
+            std::optional<IntegralTables> tables{ IntegralTables(size) };
+            tables->entries = *entries;
+            tables->cache = std::move(cache);
+            return tables;
+        }
+
+        void save(const std::filesystem::path& path, const ImageDigest& source) const
+        {
+            CacheWriter writer;
+            writer.addSection(entries);
+            writer.save(path, source);
+        }
+
+        Entry boxSum(IntRect rect) const
+        {
+            const auto at = [&](int x, int y) -> const Entry& { return entries[x + static_cast<std::size_t>(y) * size.x]; };
+            const auto end = rect.position + rect.size;
+
+            const auto& a = at(end.x, end.y);
+            const auto& b = at(rect.position.x, end.y);
+            const auto& c = at(end.x, rect.position.y);
+            const auto& d = at(rect.position.x, rect.position.y);
+
+            Entry sum;
+            sum.squares = a.squares - b.squares - c.squares + d.squares;
+            for (int channel = 0; channel < 3; channel++)
+            {
+                sum.sums[channel] = a.sums[channel] - b.sums[channel] - c.sums[channel] + d.sums[channel];
+            }
+            return sum;
+        }
+
+        Vector2i size;
+        std::span<const Entry> entries;
+
+    private:
+        explicit IntegralTables(Vector2i size) : size(size)
+        {
+        }
+
+        std::vector<Entry> storage;
+        std::shared_ptr<const CacheFile> cache;
+    };
+
+    // Scores candidates by the average RGB distance of their overlap strips to the quilt's,
+    // the corner is part of the top strip and strips without a neighbouring block are skipped
+    struct OverlapScorer
+    {
+        // Strips are scored a few rows at a time, with the quilt's colour sum of each chunk kept for the lower bounds
+        static constexpr int chunkRows = 8;
+
+        OverlapScorer() = default;
+
+        OverlapScorer(PixelView quiltView, Vector2i blockSize, Vector2i overlap, Vector2i blockPos)
+        {
+            reset(quiltView, blockSize, overlap, blockPos);
+        }
+
+        // Scores against another block, keeping the chunks' storage
+        void reset(PixelView quiltView, Vector2i blockSize, Vector2i overlap, Vector2i blockPos)
+        {
+            this->quiltView = quiltView;
+            topRect = { {}, { blockSize.x, blockPos.y > 0 ? overlap.y : 0 } };
+            leftRect = { { 0, topRect.size.y }, { blockPos.x > 0 ? overlap.x : 0, blockSize.y - topRect.size.y } };
+            topCount = static_cast<float>(topRect.size.x * topRect.size.y);
+            leftCount = static_cast<float>(leftRect.size.x * leftRect.size.y);
+            stripCount = (topCount > 0 ? 1.f : 0.f) + (leftCount > 0 ? 1.f : 0.f);
+
+            chunks.clear();
+            addChunks(topRect, false);
+            addChunks(leftRect, true);
+        }
+
+        // Once the error is known to reach `bound` the candidate can't be kept and `bound` is returned early.
+        // The known part is the rows scored so far plus, given the source's tables, a lower bound of the rest:
+        // by the triangle inequality a chunk's summed distance is at least the distance between its summed colours.
+        // Sums only grow and the margin covers float rounding, so no candidate a full scoring would keep is dropped
+        std::uint32_t operator()(PixelView candidateView, std::uint32_t bound = std::numeric_limits<std::uint32_t>::max(), const IntegralTables* tables = nullptr, Vector2i srcPos = {}) const
+        {
+            float topRemaining = 0.f;
+            float leftRemaining = 0.f;
+            if (tables)
+            {
+                for (const auto& chunk : chunks)
+                {
+                    (chunk.left ? leftRemaining : topRemaining) += chunkBound(*tables, srcPos, chunk);
+                }
+
+                if (score(topRemaining, leftRemaining, boundMargin) >= bound)
+                {
+                    return bound;
+                }
+            }
+
+            float topSum = 0.f;
+            float leftSum = 0.f;
+            for (const auto& chunk : chunks)
+            {
+                auto& sum = chunk.left ? leftSum : topSum;
+                for (int y = chunk.rect.position.y; y < chunk.rect.position.y + chunk.rect.size.y; y++)
+                {
+                    sum += rowDistanceSum(quiltView.row(y, chunk.rect.position.x), candidateView.row(y, chunk.rect.position.x), chunk.rect.size.x);
+                }
+
+                if (tables)
+                {
+                    auto& remaining = chunk.left ? leftRemaining : topRemaining;
+                    remaining = std::max(0.f, remaining - chunkBound(*tables, srcPos, chunk));
+                }
+
+                if (score(topSum + topRemaining, leftSum + leftRemaining, boundMargin) >= bound)
+                {
+                    return bound;
+                }
+            }
+
+            return score(topSum, leftSum);
+        }
+
+#if defined(__AVX2__)
+        static constexpr int batchSize = 16;
+
+        // Scores up to batchSize candidates of a grid row at once from the source's planes, candidate i at srcPos + (i * stride, 0)
+        // with srcPos.x a multiple of the stride. Each lane adds up one candidate's distances, bounds work like in operator() and
+        // scoring only stops once every candidate is known to reach `bound`, those are given `bound` in `errors`
+        void scoreBatch(const PlanarImage& planes, Vector2i srcPos, int count, std::uint32_t bound, const IntegralTables* tables, std::uint32_t* errors) const
+        {
+            const int stride = planes.getStride();
+            const auto pitch = static_cast<std::ptrdiff_t>(planes.getPitch());
+
+            // Lane l of the sums belongs to candidate laneCandidates[l], as unpacking to 32 bits interleaves the 128 bit halves
+            static constexpr std::array<int, batchSize> laneCandidates = { 0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15 };
+
+            std::array<float, batchSize> topRemaining{};
+            std::array<float, batchSize> leftRemaining{};
+            std::array<std::array<float, batchSize>, 2> sums{};
+
+            const auto isDone = [&]
+            {
+                for (int lane = 0; lane < batchSize; lane++)
+                {
+                    if (laneCandidates[lane] < count && score(sums[0][lane] + topRemaining[lane], sums[1][lane] + leftRemaining[lane], boundMargin) < bound)
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            };
+
+            const auto candidatePos = [&](int lane) { return srcPos + Vector2i(laneCandidates[lane] * stride, 0); };
+
+            if (tables)
+            {
+                for (const auto& chunk : chunks)
+                {
+                    auto& remaining = chunk.left ? leftRemaining : topRemaining;
+                    for (int lane = 0; lane < batchSize; lane++)
+                    {
+                        if (laneCandidates[lane] < count)
+                        {
+                            remaining[lane] += chunkBound(*tables, candidatePos(lane), chunk);
+                        }
+                    }
+                }
+
+                if (isDone())
+                {
+                    std::fill_n(errors, count, bound);
+                    return;
+                }
+            }
+
+            __m256 accumulators[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+            const auto zero = _mm256_setzero_si256();
+            for (const auto& chunk : chunks)
+            {
+                auto& low = accumulators[chunk.left ? 2 : 0];
+                auto& high = accumulators[chunk.left ? 3 : 1];
+                for (int y = chunk.rect.position.y; y < chunk.rect.position.y + chunk.rect.size.y; y++)
+                {
+                    const auto quiltRow = quiltView.row(y, chunk.rect.position.x);
+                    const std::uint8_t* srcRow = planes.row(srcPos.y + y, 0, 0) + srcPos.x / stride;
+
+                    int phase = chunk.rect.position.x % stride;
+                    int offset = chunk.rect.position.x / stride;
+                    for (int x = 0; x < chunk.rect.size.x; x++)
+                    {
+                        // 16 candidates' red, green and blue against one quilt pixel, widened to 16 bits
+                        const auto pixels = srcRow + phase * 3 * pitch + offset;
+                        __m256i differences[3];
+                        for (int c = 0; c < 3; c++)
+                        {
+                            const auto values = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pixels + c * pitch)));
+                            differences[c] = _mm256_sub_epi16(values, _mm256_set1_epi16(quiltRow[x * 4 + c]));
+                        }
+
+                        // r² + g² from the interleaved red and green pairs, b² from blue paired with zero
+                        const auto redGreenLow = _mm256_unpacklo_epi16(differences[0], differences[1]);
+                        const auto redGreenHigh = _mm256_unpackhi_epi16(differences[0], differences[1]);
+                        const auto blueLow = _mm256_unpacklo_epi16(differences[2], zero);
+                        const auto blueHigh = _mm256_unpackhi_epi16(differences[2], zero);
+
+                        const auto squaresLow = _mm256_add_epi32(_mm256_madd_epi16(redGreenLow, redGreenLow), _mm256_madd_epi16(blueLow, blueLow));
+                        const auto squaresHigh = _mm256_add_epi32(_mm256_madd_epi16(redGreenHigh, redGreenHigh), _mm256_madd_epi16(blueHigh, blueHigh));
+
+                        low = _mm256_add_ps(low, _mm256_sqrt_ps(_mm256_cvtepi32_ps(squaresLow)));
+                        high = _mm256_add_ps(high, _mm256_sqrt_ps(_mm256_cvtepi32_ps(squaresHigh)));
+
+                        if (++phase == stride)
+                        {
+                            phase = 0;
+                            offset++;
+                        }
+                    }
+                }
+
+                for (int strip = 0; strip < 2; strip++)
+                {
+                    _mm256_storeu_ps(sums[strip].data(), accumulators[strip * 2]);
+                    _mm256_storeu_ps(sums[strip].data() + 8, accumulators[strip * 2 + 1]);
+                }
+
+                if (tables)
+                {
+                    auto& remaining = chunk.left ? leftRemaining : topRemaining;
+                    for (int lane = 0; lane < batchSize; lane++)
+                    {
+                        if (laneCandidates[lane] < count)
+                        {
+                            remaining[lane] = std::max(0.f, remaining[lane] - chunkBound(*tables, candidatePos(lane), chunk));
+                        }
+                    }
+                }
+
+                if (isDone())
+                {
+                    std::fill_n(errors, count, bound);
+                    return;
+                }
+            }
+
+            for (int lane = 0; lane < batchSize; lane++)
+            {
+                if (laneCandidates[lane] < count)
+                {
+                    errors[laneCandidates[lane]] = score(sums[0][lane], sums[1][lane]);
+                }
+            }
+        }
+#endif
+
+    private:
+        static constexpr float boundMargin = 0.999f;
+
+        struct Chunk
+        {
+            IntRect rect;
+            std::array<std::int64_t, 3> quiltSum{};
+            bool left{};
+        };
+
+        void addChunks(IntRect strip, bool left)
+        {
+            for (int y = strip.position.y; y < strip.position.y + strip.size.y; y += chunkRows)
+            {
+                Chunk chunk{ { { strip.position.x, y }, { strip.size.x, std::min(chunkRows, strip.position.y + strip.size.y - y) } }, {}, left };
+                for (int row = 0; row < chunk.rect.size.y; row++)
+                {
+                    const auto pixels = quiltView.row(y + row, strip.position.x);
+                    for (int x = 0; x < strip.size.x; x++)
+                    {
+                        for (int c = 0; c < 3; c++)
+                        {
+                            chunk.quiltSum[c] += pixels[x * 4 + c];
+                        }
+                    }
+                }
+                chunks.push_back(chunk);
+            }
+        }
+
+        float chunkBound(const IntegralTables& tables, Vector2i srcPos, const Chunk& chunk) const
+        {
+            const auto srcSum = tables.boxSum({ srcPos + chunk.rect.position, chunk.rect.size });
+
+            double squared = 0.0;
+            for (int c = 0; c < 3; c++)
+            {
+                const auto difference = static_cast<double>(chunk.quiltSum[c] - static_cast<std::int64_t>(srcSum.sums[c]));
+                squared += difference * difference;
+            }
+            return static_cast<float>(std::sqrt(squared));
+        }
+
+        std::uint32_t score(float topSum, float leftSum, float margin = 1.f) const
+        {
+            float average = 0.f;
+            if (topCount > 0)
+            {
+                average += topSum / topCount;
+            }
+            if (leftCount > 0)
+            {
+                average += leftSum / leftCount;
+            }
+
+            return static_cast<std::uint32_t>(average * margin / stripCount * 255.f);
+        }
+
+        PixelView quiltView;
+        IntRect topRect;
+        IntRect leftRect;
+        float topCount{};
+        float leftCount{};
+        float stripCount{};
+        std::vector<Chunk> chunks;
+    };
+
+    // Scores every position of a grid laid over the source and keeps the `capacity` best of each band of rows,
+    // there's one band per thread and since every candidate is scored on its own the split can't change any error.
+    // Scoring stops as soon as a candidate can't beat the worst one its band keeps, which is faster with tables.
+    // Given the source's planes for this stride, candidates are scored a batch at a time instead
+    void scoreCandidateGrid(ThreadPool& threadPool, const OverlapScorer& scorer, const ImageRef& srcImage, [[maybe_unused]] const PlanarImage* planes, const IntegralTables* tables, Vector2i grid, int stride, int capacity,
+        std::vector<TopCandidates>& bands)
+    {
+        const int bandCount = std::min(threadPool.getThreadCount(), grid.y);
+        bands.resize(bandCount);
+        for (auto& band : bands)
+        {
+            band.reset(capacity);
+        }
+
+        threadPool.parallelFor(bandCount, [&](int band)
+        {
+            auto& candidates = bands[band];
+            for (int y = band * grid.y / bandCount; y < (band + 1) * grid.y / bandCount; y++)
+            {
+#if defined(__AVX2__)
+                if (planes)
+                {
+                    // A batch is scored against the bound from before it, which only lets through candidates the bound would have dropped
+                    std::array<std::uint32_t, OverlapScorer::batchSize> errors;
+                    for (int x = 0; x < grid.x; x += OverlapScorer::batchSize)
+                    {
+                        const int count = std::min(OverlapScorer::batchSize, grid.x - x);
+                        scorer.scoreBatch(*planes, Vector2i(x, y) * stride, count, candidates.bound(), tables, errors.data());
+                        for (int i = 0; i < count; i++)
+                        {
+                            candidates.push(errors[i], x + i + y * grid.x);
+                        }
+                    }
+                    continue;
+                }
+#endif
+
+                for (int x = 0; x < grid.x; x++)
+                {
+                    const auto srcPos = Vector2i(x, y) * stride;
+                    candidates.push(scorer(PixelView(srcImage, srcPos), candidates.bound(), tables, srcPos), x + y * grid.x);
+                }
+            }
+        });
+    }
+
+    // What selectBestBlockCpu builds for every block, kept by the caller so the storage is reused
+    struct CpuSelectionScratch
+    {
+        OverlapScorer scorer;
+        std::vector<TopCandidates> bands;
+        std::vector<TopCandidates::Candidate> candidates;
+    };
+
+    // Only positions on a grid of searchStride are scored, the rest can't be picked
+    template<typename RndEngine>
+    Vector2i selectBestBlockCpu(const WeightedBlockSelection& settings, RndEngine& rngEngine, ThreadPool& threadPool, const IntegralTables& tables, const ImageRef& srcImage, const PlanarImage* planes, const Canvas& canvas, Vector2i blockSize, Vector2i blockPos, Vector2i overlap,
+        CpuSelectionScratch& scratch)
+    {
+        const auto area = Vector2i(srcImage.getSize()) - blockSize;
+        const auto stride = settings.searchStride;
+        const Vector2i grid((area.x + stride - 1) / stride, (area.y + stride - 1) / stride);
+        const auto count = grid.x * grid.y;
+
+        scratch.scorer.reset(canvas.getView(blockPos), blockSize, overlap, blockPos);
+        scoreCandidateGrid(threadPool, scratch.scorer, srcImage, planes, &tables, grid, stride, selectionCount(count, settings.selectionSpan), scratch.bands);
+
+        const auto selectionIndex = weightedSelection(rngEngine, scratch.bands, count, settings.selectionSpan, scratch.candidates);
+        return Vector2i(selectionIndex % grid.x, selectionIndex / grid.x) * stride;
+    }
+
+    // Blurs with a 5 tap binomial kernel (clamping at the borders) and keeps every other pixel, `rows` holds the horizontal pass
+    void downsample(const ImageRef& image, Image& result, std::vector<std::array<int, 4>>& rows)
+    {
+        const auto size = Vector2i(image.getSize());
+        const Vector2i halfSize(std::max(1, size.x / 2), std::max(1, size.y / 2));
+
+        const auto src = (const Color*)image.getPixelsPtr();
+        const auto at = [&](int x, int y) -> const Color& { return src[std::clamp(x, 0, size.x - 1) + std::clamp(y, 0, size.y - 1) * size.x]; };
+
+        static constexpr std::array<int, 5> kernel = { 1, 4, 6, 4, 1 };
+
+        // Horizontal pass at half width, then the vertical one at half height
+        rows.resize(static_cast<std::size_t>(halfSize.x) * size.y);
+        for (int y = 0; y < size.y; y++)
+        {
+            for (int x = 0; x < halfSize.x; x++)
+            {
+                std::array<int, 4> sum{};
+                for (int k = 0; k < 5; k++)
+                {
+                    const auto& color = at(x * 2 + k - 2, y);
+                    sum[0] += color.r * kernel[k];
+                    sum[1] += color.g * kernel[k];
+                    sum[2] += color.b * kernel[k];
+                    sum[3] += color.a * kernel[k];
+                }
+                rows[x + static_cast<std::size_t>(y) * halfSize.x] = sum;
+            }
+        }
+
+        fitImage(result, Vector2u(halfSize));
+        for (int y = 0; y < halfSize.y; y++)
+        {
+            for (int x = 0; x < halfSize.x; x++)
+            {
+                std::array<int, 4> sum{};
+                for (int k = 0; k < 5; k++)
+                {
+                    const auto& row = rows[x + static_cast<std::size_t>(std::clamp(y * 2 + k - 2, 0, size.y - 1)) * halfSize.x];
+                    for (int c = 0; c < 4; c++)
+                    {
+                        sum[c] += row[c] * kernel[k];
+                    }
+                }
+
+                setPixel(result, Vector2u(x, y), Color(
+                    static_cast<std::uint8_t>((sum[0] + 128) / 256),
+                    static_cast<std::uint8_t>((sum[1] + 128) / 256),
+                    static_cast<std::uint8_t>((sum[2] + 128) / 256),
+                    static_cast<std::uint8_t>((sum[3] + 128) / 256)));
+            }
+        }
+    }
+
+    Image downsample(const ImageRef& image)
+    {
+        Image result;
+        std::vector<std::array<int, 4>> rows;
+        downsample(image, result, rows);
+        return result;
+    }
+
+    // Power of two sized 2D FFT, forward transforms leave the spectrum transposed (and inverse ones expect it)
+    // which saves transposing back since spectra are only ever multiplied together
+    class Fft2d
+    {
+    public:
+        using Complex = std::complex<float>;
+
+        explicit Fft2d(Vector2i size) : size(size), rows(size.x), columns(size.y)
+        {
+        }
+
+        Vector2i getSize() const
+        {
+            return size;
+        }
+
+        void forward(std::vector<Complex>& data, std::vector<Complex>& scratch, ThreadPool& threadPool, int nonZeroRows) const
+        {
+            transformRows(data.data(), rows, nonZeroRows, false, threadPool);
+            transpose(data.data(), scratch.data(), size, threadPool);
+            transformRows(scratch.data(), columns, size.x, false, threadPool);
+            std::swap(data, scratch);
+        }
+
+        void inverse(std::vector<Complex>& data, std::vector<Complex>& scratch, ThreadPool& threadPool) const
+        {
+            transformRows(data.data(), columns, size.x, true, threadPool);
+            transpose(data.data(), scratch.data(), { size.y, size.x }, threadPool);
+            transformRows(scratch.data(), rows, size.y, true, threadPool);
+            std::swap(data, scratch);
+        }
+
+    private:
+        struct Plan
+        {
+            explicit Plan(int length) : length(length), twiddles(length / 2), reversed(length)
+            {
+                for (int x = 0; x < length / 2; x++)
+                {
+                    const auto angle = -2.0 * std::numbers::pi * x / length;
+                    twiddles[x] = Complex(static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)));
+                }
+
+                int bits = 0;
+                while ((1 << bits) < length)
+                {
+                    bits++;
+                }
+
+                for (int x = 0; x < length; x++)
+                {
+                    int reverse = 0;
+                    for (int bit = 0; bit < bits; bit++)
+                    {
+                        reverse |= ((x >> bit) & 1) << (bits - 1 - bit);
+                    }
+                    reversed[x] = reverse;
+                }
+            }
+
+            void transform(Complex* data, bool inverse) const
+            {
+                for (int x = 0; x < length; x++)
+                {
+                    if (x < reversed[x])
+                    {
+                        std::swap(data[x], data[reversed[x]]);
+                    }
+                }
+
+                const float sign = inverse ? -1.f : 1.f;
+                for (int span = 2; span <= length; span <<= 1)
+                {
+                    const int half = span / 2;
+                    const int step = length / span;
+                    for (int start = 0; start < length; start += span)
+                    {
+                        for (int x = 0; x < half; x++)
+                        {
+                            const auto w = twiddles[x * step];
+                            const float wr = w.real();
+                            const float wi = w.imag() * sign;
+
+                            auto& a = data[start + x];
+                            auto& b = data[start + x + half];
+
+                            // Written out by hand, std::complex multiplication has to care about infinities
+                            const Complex v(b.real() * wr - b.imag() * wi, b.real() * wi + b.imag() * wr);
+                            b = a - v;
+                            a = a + v;
+                        }
+                    }
+                }
+            }
+
+            int length;
+            std::vector<Complex> twiddles;
+            std::vector<int> reversed;
+        };
+
+        static void transformRows(Complex* data, const Plan& plan, int rowCount, bool inverse, ThreadPool& threadPool)
+        {
+            threadPool.parallelFor(rowCount, [&](int row)
+            {
+                plan.transform(data + static_cast<std::size_t>(row) * plan.length, inverse);
+            });
+        }
+
+        static void transpose(const Complex* src, Complex* dst, Vector2i srcSize, ThreadPool& threadPool)
+        {
+            constexpr int tile = 32;
+            threadPool.parallelFor((srcSize.y + tile - 1) / tile, [&](int tileY)
+            {
+                const int endY = std::min(srcSize.y, (tileY + 1) * tile);
+                for (int startX = 0; startX < srcSize.x; startX += tile)
+                {
+                    const int endX = std::min(srcSize.x, startX + tile);
+                    for (int y = tileY * tile; y < endY; y++)
+                    {
+                        for (int x = startX; x < endX; x++)
+                        {
+                            dst[y + static_cast<std::size_t>(x) * srcSize.y] = src[x + static_cast<std::size_t>(y) * srcSize.x];
+                        }
+                    }
+                }
+            });
+        }
+
+        Vector2i size;
+        Plan rows;
+        Plan columns;
+    };
+
+    // Channels are centered around 0 before transforming to keep the float correlations precise
+    constexpr float fftChannelOffset = 128.f;
+
+    // Spectra of the source channels
+    struct SourceSpectra
+    {
+        SourceSpectra(const ImageRef& srcImage, ThreadPool& threadPool) : fft(paddedSize(Vector2i(srcImage.getSize())))
+        {
+            const auto srcSize = Vector2i(srcImage.getSize());
+            const auto fftSize = fft.getSize();
+            const auto planeSize = static_cast<std::size_t>(fftSize.x) * fftSize.y;
+
+            std::vector<Fft2d::Complex> scratch(planeSize);
+
+            const auto srcPtr = (const Color*)srcImage.getPixelsPtr();
+            for (int c = 0; c < 3; c++)
+            {
+                auto& plane = channels[c];
+                plane.resize(planeSize);
+
+                for (int y = 0; y < srcSize.y; y++)
+                {
+                    for (int x = 0; x < srcSize.x; x++)
+                    {
+                        const auto color = srcPtr[x + y * srcSize.x];
+                        const std::uint8_t values[3] = { color.r, color.g, color.b };
+                        plane[x + static_cast<std::size_t>(y) * fftSize.x] = values[c] - fftChannelOffset;
+                    }
+                }
+
+                fft.forward(plane, scratch, threadPool, srcSize.y);
+            }
+        }
+
+        static Vector2i paddedSize(Vector2i size)
+        {
+            return { static_cast<int>(std::bit_ceil(static_cast<unsigned>(size.x))), static_cast<int>(std::bit_ceil(static_cast<unsigned>(size.y))) };
+        }
+
+        Fft2d fft;
+        std::array<std::vector<Fft2d::Complex>, 3> channels;
+    };
+
+    // Mean colours over a grid of cells covering the overlap strips, each weighted by the square root of its area
+    // so the squared distance between two descriptors approximates the squared error between the pooled overlaps
+    struct DescriptorLayout
+    {
+        static constexpr int maxCellCount = 64;
+
+        DescriptorLayout(Vector2i blockSize, Vector2i overlap, OverlapKind kind)
+        {
+            const bool hasTop = kind != OverlapKind::Left;
+            const bool hasLeft = kind != OverlapKind::Top;
+
+            const IntRect topRect{ {}, { blockSize.x, hasTop ? overlap.y : 0 } };
+            const IntRect leftRect{ { 0, topRect.size.y }, { hasLeft ? overlap.x : 0, blockSize.y - topRect.size.y } };
+
+            const auto overlapArea = topRect.size.x * topRect.size.y + leftRect.size.x * leftRect.size.y;
+            const int cellSize = std::max(1, static_cast<int>(std::ceil(std::sqrt(overlapArea / static_cast<float>(maxCellCount)))));
+
+            for (const auto& rect : { topRect, leftRect })
+            {
+                for (int y = 0; y < rect.size.y; y += cellSize)
+                {
+                    for (int x = 0; x < rect.size.x; x += cellSize)
+                    {
+                        const IntRect cell{ rect.position + Vector2i(x, y), { std::min(cellSize, rect.size.x - x), std::min(cellSize, rect.size.y - y) } };
+                        cells.push_back(cell);
+                        weights.push_back(std::sqrt(static_cast<float>(cell.size.x * cell.size.y)));
+                    }
+                }
+            }
+        }
+
+        int getSize() const
+        {
+            return static_cast<int>(cells.size()) * 3;
+        }
+
+        void describeSource(const IntegralTables& tables, Vector2i pos, float* descriptor) const
+        {
+            for (std::size_t x = 0; x < cells.size(); x++)
+            {
+                const IntRect rect{ cells[x].position + pos, cells[x].size };
+                const auto scale = weights[x] / static_cast<float>(rect.size.x * rect.size.y);
+                const auto sum = tables.boxSum(rect);
+                for (int c = 0; c < 3; c++)
+                {
+                    descriptor[x * 3 + c] = static_cast<float>(static_cast<std::int64_t>(sum.sums[c])) * scale;
+                }
+            }
+        }
+
+        void describeQuilt(const Canvas& canvas, Vector2i blockPos, float* descriptor) const
+        {
+            const auto view = canvas.getView(blockPos);
+            for (std::size_t x = 0; x < cells.size(); x++)
+            {
+                const auto& rect = cells[x];
+                std::array<std::uint32_t, 3> sums{};
+                for (int y = rect.position.y; y < rect.position.y + rect.size.y; y++)
+                {
+                    const auto row = view.row(y, rect.position.x);
+                    for (int i = 0; i < rect.size.x; i++)
+                    {
+                        for (int c = 0; c < 3; c++)
+                        {
+                            sums[c] += row[i * 4 + c];
+                        }
+                    }
+                }
+
+                const auto scale = weights[x] / static_cast<float>(rect.size.x * rect.size.y);
+                for (int c = 0; c < 3; c++)
+                {
+                    descriptor[x * 3 + c] = static_cast<float>(sums[c]) * scale;
+                }
+            }
+        }
+
+        std::vector<IntRect> cells;
+        std::vector<float> weights;
+    };
+
+    struct PatchIndexKey
+    {
+        Vector2i blockSize;
+        Vector2i overlap;
+        OverlapKind kind;
+        int dimensions;
+        int stride;
+
+        auto operator<=>(const PatchIndexKey& other) const
+        {
+            return std::tie(blockSize.x, blockSize.y, overlap.x, overlap.y, kind, dimensions, stride)
+                <=> std::tie(other.blockSize.x, other.blockSize.y, other.overlap.x, other.overlap.y, other.kind, other.dimensions, other.stride);
+        }
+    };
+
+    // PCA projected overlap descriptors of every candidate position stored in a kd-tree
+    class PatchIndex
+    {
+    public:
+        struct Neighbour
+        {
+            float distance;
+            int candidate;
+
+            bool operator<(const Neighbour& other) const
+            {
+                return std::tie(distance, candidate) < std::tie(other.distance, other.candidate);
+            }
+        };
+
+        PatchIndex(const ImageRef& srcImage, const IntegralTables& tables, const PatchIndexKey& key, ThreadPool& threadPool) :
+            PatchIndex(srcImage.getSize(), key)
+        {
+            const int descriptorSize = layout.getSize();
+
+            computeBasis(tables);
+
+            const auto candidateCount = grid.x * grid.y;
+            pointStorage.resize(static_cast<std::size_t>(candidateCount) * dimensions);
+
+            threadPool.parallelFor(grid.y, [&](int y)
+            {
+                std::vector<float> descriptor(descriptorSize);
+                for (int x = 0; x < grid.x; x++)
+                {
+                    layout.describeSource(tables, Vector2i(x, y) * stride, descriptor.data());
+                    project(descriptor.data(), &pointStorage[(x + static_cast<std::size_t>(y) * grid.x) * dimensions]);
+                }
+            });
+
+            candidateStorage.resize(candidateCount);
+            std::iota(candidateStorage.begin(), candidateStorage.end(), 0);
+            buildNode(0, candidateCount);
+
+            // Store the points in tree order so leaves are contiguous in memory
+            std::vector<float> sorted(pointStorage.size());
+            for (int x = 0; x < candidateCount; x++)
+            {
+                std::copy_n(&pointStorage[static_cast<std::size_t>(candidateStorage[x]) * dimensions], dimensions, &sorted[static_cast<std::size_t>(x) * dimensions]);
+            }
+            pointStorage = std::move(sorted);
+
+            points = pointStorage;
+            candidates = candidateStorage;
+            nodes = nodeStorage;
+        }
+
+        PatchIndex(PatchIndex&&) = default;
+        PatchIndex& operator=(PatchIndex&&) = default;
+
+        // The tree and points are used in place from the mapped file, anything that could send a search
+        // out of bounds is checked first since the file could come from an older or interrupted run
+        static std::optional<PatchIndex> load(Vector2u srcSize, const PatchIndexKey& key, std::shared_ptr<const CacheFile> cache)
+        {
+            PatchIndex index(srcSize, key);
+
+            const auto candidateCount = static_cast<std::size_t>(index.grid.x) * index.grid.y;
+            const auto projectedMean = cache->getSection<float>(0, index.dimensions);
+            const auto transposedBasis = cache->getSection<float>(1, static_cast<std::size_t>(index.layout.getSize()) * index.dimensions);
+            const auto points = cache->getSection<float>(2, candidateCount * index.dimensions);
+            const auto candidates = cache->getSection<int>(3, candidateCount);
+            const auto nodes = cache->getSection<Node>(4, cache->getSectionCount<Node>(4));
+            if (!projectedMean || !transposedBasis || !points || !candidates || !nodes || nodes->empty())
+            {
+                return std::nullopt;
+            }
+
+            // Children always come after their parent, which also rules out cycles
+            const auto nodeCount = static_cast<int>(nodes->size());
+            for (int x = 0; x < nodeCount; x++)
+            {
+                const auto& node = (*nodes)[x];
+                const bool validRange = node.begin >= 0 && node.begin <= node.end && node.end <= static_cast<int>(candidateCount);
+                const bool validChildren = node.axis < 0 || (node.axis < index.dimensions && node.left > x && node.left < nodeCount && node.right > x && node.right < nodeCount);
+                if (!validRange || !validChildren)
+                {
+                    return std::nullopt;
+                }
+            }
+
+            if (std::any_of(candidates->begin(), candidates->end(), [&](int candidate) { return candidate < 0 || candidate >= static_cast<int>(candidateCount); }))
+            {
+                return std::nullopt;
+            }
+
+            index.projectedMean.assign(projectedMean->begin(), projectedMean->end());
+            index.transposedBasis.assign(transposedBasis->begin(), transposedBasis->end());
+            index.points = *points;
+            index.candidates = *candidates;
+            index.nodes = *nodes;
+            index.cache = std::move(cache);
+            return index;
+        }
+
+        void save(const std::filesystem::path& path, const ImageDigest& source) const
+        {
+            CacheWriter writer;
+            writer.addSection(std::span<const float>(projectedMean));
+            writer.addSection(std::span<const float>(transposedBasis));
+            writer.addSection(points);
+            writer.addSection(candidates);
+            writer.addSection(nodes);
+            writer.save(path, source);
+        }
+
+        const DescriptorLayout& getLayout() const
+        {
+            return layout;
+        }
+
+        Vector2i getPosition(int candidate) const
+        {
+            return Vector2i(candidate % grid.x, candidate / grid.x) * stride;
+        }
+
+        // The count nearest candidates to the raw descriptor, closest first. `projected` holds the descriptor's projection
+        void query(const float* descriptor, int count, std::vector<float>& projected, std::vector<Neighbour>& neighbours) const
+        {
+            projected.resize(dimensions);
+            project(descriptor, projected.data());
+
+            neighbours.clear();
+            search(0, projected.data(), count, neighbours);
+            std::sort_heap(neighbours.begin(), neighbours.end());
+        }
+
+    private:
+        static constexpr int leafSize = 16;
+        static constexpr int basisSampleCount = 4096;
+        static constexpr int powerIterations = 64;
+        static constexpr int spreadSampleCount = 256;
+
+        PatchIndex(Vector2u srcSize, const PatchIndexKey& key) :
+            layout(key.blockSize, key.overlap, key.kind),
+            stride(key.stride)
+        {
+            const auto area = Vector2i(srcSize) - key.blockSize;
+            grid = { (area.x + stride - 1) / stride, (area.y + stride - 1) / stride };
+            dimensions = std::min(key.dimensions, layout.getSize());
+        }
+
+        struct Node
+        {
+            int axis = -1;
+            float split{};
+            int begin{};
+            int end{};
+            int left{};
+            int right{};
+        };
+
+        // Principal components of a regular sample of the candidate descriptors, found by power iteration with deflation
+        void computeBasis(const IntegralTables& tables)
+        {
+            const int descriptorSize = layout.getSize();
+            const auto candidateCount = grid.x * grid.y;
+            const int sampleCount = std::min(candidateCount, basisSampleCount);
+
+            std::vector<float> samples(static_cast<std::size_t>(sampleCount) * descriptorSize);
+            for (int x = 0; x < sampleCount; x++)
+            {
+                const auto candidate = static_cast<int>(static_cast<std::int64_t>(x) * candidateCount / sampleCount);
+                layout.describeSource(tables, getPosition(candidate), &samples[static_cast<std::size_t>(x) * descriptorSize]);
+            }
+
+            mean.assign(descriptorSize, 0.f);
+            for (int x = 0; x < sampleCount; x++)
+            {
+                for (int d = 0; d < descriptorSize; d++)
+                {
+                    mean[d] += samples[static_cast<std::size_t>(x) * descriptorSize + d] / sampleCount;
+                }
+            }
+
+            std::vector<double> covariance(static_cast<std::size_t>(descriptorSize) * descriptorSize);
+            for (int x = 0; x < sampleCount; x++)
+            {
+                const auto sample = &samples[static_cast<std::size_t>(x) * descriptorSize];
+                for (int i = 0; i < descriptorSize; i++)
+                {
+                    const double a = sample[i] - mean[i];
+                    for (int j = 0; j < descriptorSize; j++)
+                    {
+                        covariance[i * descriptorSize + j] += a * (sample[j] - mean[j]);
+                    }
+                }
+            }
+
+            basis.assign(static_cast<std::size_t>(dimensions) * descriptorSize, 0.f);
+            std::vector<double> vector(descriptorSize);
+            std::vector<double> next(descriptorSize);
+            for (int component = 0; component < dimensions; component++)
+            {
+                std::fill(vector.begin(), vector.end(), 1.0);
+                vector[component] += descriptorSize;
+
+                for (int iteration = 0; iteration < powerIterations; iteration++)
+                {
+                    for (int i = 0; i < descriptorSize; i++)
+                    {
+                        next[i] = std::inner_product(vector.begin(), vector.end(), covariance.begin() + i * descriptorSize, 0.0);
+                    }
+
+                    for (int previous = 0; previous < component; previous++)
+                    {
+                        const auto axis = &basis[static_cast<std::size_t>(previous) * descriptorSize];
+                        const auto dot = std::inner_product(next.begin(), next.end(), axis, 0.0);
+                        for (int i = 0; i < descriptorSize; i++)
+                        {
+                            next[i] -= dot * axis[i];
+                        }
+                    }
+
+                    const auto norm = std::sqrt(std::inner_product(next.begin(), next.end(), next.begin(), 0.0));
+                    if (norm <= 0.0)
+                    {
+                        break;
+                    }
+
+                    for (int i = 0; i < descriptorSize; i++)
+                    {
+                        vector[i] = next[i] / norm;
+                    }
+                }
+
+                std::copy(vector.begin(), vector.end(), &basis[static_cast<std::size_t>(component) * descriptorSize]);
+            }
+
+            transposedBasis.resize(basis.size());
+            projectedMean.assign(dimensions, 0.f);
+            for (int component = 0; component < dimensions; component++)
+            {
+                for (int i = 0; i < descriptorSize; i++)
+                {
+                    const auto value = basis[static_cast<std::size_t>(component) * descriptorSize + i];
+                    transposedBasis[static_cast<std::size_t>(i) * dimensions + component] = value;
+                    projectedMean[component] -= mean[i] * value;
+                }
+            }
+        }
+
+        // Goes through the basis transposed so the inner loop runs over independent components
+        void project(const float* descriptor, float* projected) const
+        {
+            const int descriptorSize = layout.getSize();
+            std::copy(projectedMean.begin(), projectedMean.end(), projected);
+            for (int i = 0; i < descriptorSize; i++)
+            {
+                const auto value = descriptor[i];
+                const auto row = &transposedBasis[static_cast<std::size_t>(i) * dimensions];
+                for (int component = 0; component < dimensions; component++)
+                {
+                    projected[component] += value * row[component];
+                }
+            }
+        }
+
+        float coordinate(int candidate, int axis) const
+        {
+            return pointStorage[static_cast<std::size_t>(candidate) * dimensions + axis];
+        }
+
+        // Splits on the median of the axis with the widest spread, before the points are reordered
+        // candidates[begin, end) refers to the unsorted points
+        int buildNode(int begin, int end)
+        {
+            const int nodeIndex = static_cast<int>(nodeStorage.size());
+            nodeStorage.push_back({ -1, 0.f, begin, end });
+
+            if (end - begin <= leafSize)
+            {
+                return nodeIndex;
+            }
+
+            // The spread is estimated on a regular sample, scanning every point of big nodes costs more than it gains
+            const int step = std::max(1, (end - begin) / spreadSampleCount);
+
+            int axis = 0;
+            float widestSpread = -1.f;
+            for (int d = 0; d < dimensions; d++)
+            {
+                float min = std::numeric_limits<float>::max();
+                float max = std::numeric_limits<float>::lowest();
+                for (int x = begin; x < end; x += step)
+                {
+                    const auto value = coordinate(candidateStorage[x], d);
+                    min = std::min(min, value);
+                    max = std::max(max, value);
+                }
+
+                if (max - min > widestSpread)
+                {
+                    widestSpread = max - min;
+                    axis = d;
+                }
+            }
+
+            const int middle = begin + (end - begin) / 2;
+            std::nth_element(candidateStorage.begin() + begin, candidateStorage.begin() + middle, candidateStorage.begin() + end, [&](int a, int b)
+            {
+                return std::make_pair(coordinate(a, axis), a) < std::make_pair(coordinate(b, axis), b);
+            });
+
+            const auto split = coordinate(candidateStorage[middle], axis);
+            const int left = buildNode(begin, middle);
+            const int right = buildNode(middle, end);
+
+            nodeStorage[nodeIndex].axis = axis;
+            nodeStorage[nodeIndex].split = split;
+            nodeStorage[nodeIndex].left = left;
+            nodeStorage[nodeIndex].right = right;
+            return nodeIndex;
+        }
+
+        void search(int nodeIndex, const float* point, int count, std::vector<Neighbour>& heap) const
+        {
+            const auto& node = nodes[nodeIndex];
+            if (node.axis < 0)
+            {
+                for (int x = node.begin; x < node.end; x++)
+                {
+                    const auto position = &points[static_cast<std::size_t>(x) * dimensions];
+                    float distance = 0.f;
+                    for (int d = 0; d < dimensions; d++)
+                    {
+                        const auto difference = point[d] - position[d];
+                        distance += difference * difference;
+                    }
+
+                    const Neighbour neighbour{ distance, candidates[x] };
+                    if (static_cast<int>(heap.size()) < count)
+                    {
+                        heap.push_back(neighbour);
+                        std::push_heap(heap.begin(), heap.end());
+                    }
+                    else if (neighbour < heap.front())
+                    {
+                        std::pop_heap(heap.begin(), heap.end());
+                        heap.back() = neighbour;
+                        std::push_heap(heap.begin(), heap.end());
+                    }
+                }
+                return;
+            }
+
+            const auto difference = point[node.axis] - node.split;
+            search(difference < 0.f ? node.left : node.right, point, count, heap);
+
+            if (static_cast<int>(heap.size()) < count || difference * difference <= heap.front().distance)
+            {
+                search(difference < 0.f ? node.right : node.left, point, count, heap);
+            }
+        }
+
+        DescriptorLayout layout;
+        int stride{};
+        int dimensions{};
+        Vector2i grid;
+
+        std::vector<float> mean;
+        std::vector<float> basis;
+        std::vector<float> transposedBasis;
+        std::vector<float> projectedMean;
+
+        // Views of either the storage built here or a mapped cache file
+        std::span<const float> points;
+        std::span<const int> candidates;
+        std::span<const Node> nodes;
+
+        std::vector<float> pointStorage;
+        std::vector<int> candidateStorage;
+        std::vector<Node> nodeStorage;
+        std::shared_ptr<const CacheFile> cache;
+    };
+
+    // Everything derived from a source image alone, built lazily the first time it's needed
+    // and shared by every block (and every quilt) made from that source.
+    // With a cache directory the tables, pyramid and patch indices are also saved there, named after
+    // the source's content hash, and later runs map them back instead of building them again
+    class SourceAnalysis
+    {
+    public:
+        // `ownedImage` keeps the pixels alive when they were converted from the caller's, otherwise the caller keeps them
+        SourceAnalysis(ImageRef image, std::shared_ptr<const Image> ownedImage, const std::string& cacheDirectory) :
+            image(image), ownedImage(std::move(ownedImage)), cacheDirectory(cacheDirectory), key(std::make_shared<CacheKey>())
+        {
+        }
+
+        // The same pixels with another cache directory, they keep the digest if it was already taken
+        SourceAnalysis(const SourceAnalysis& other, const std::string& cacheDirectory) :
+            image(other.image), ownedImage(other.ownedImage), cacheDirectory(cacheDirectory), key(other.key)
+        {
+        }
+
+        ImageRef getImage() const
+        {
+            return image;
+        }
+
+        const std::string& getCacheDirectory() const
+        {
+            return cacheDirectory;
+        }
+
+        bool isOpaque() const
+        {
+            std::call_once(opaqueFlag, [&]
+            {
+                const std::uint8_t* pixels = image.getPixelsPtr();
+                opaque = true;
+                for (std::size_t i = 3; i < static_cast<std::size_t>(image.getSize().x) * image.getSize().y * 4; i += 4)
+                {
+                    opaque = opaque && pixels[i] == 255;
+                }
+            });
+            return opaque;
+        }
+
+        const IntegralTables& getIntegralTables() const
+        {
+            std::call_once(integralTablesFlag, [&]
+            {
+                const auto path = getCachePath("tables");
+                if (const auto cache = openCache(path))
+                {
+                    integralTables = IntegralTables::load(image.getSize(), cache);
+                }
+
+                if (!integralTables)
+                {
+                    integralTables.emplace(image);
+                    if (!path.empty())
+                    {
+                        integralTables->save(path, getDigest());
+                    }
+                }
+            });
+            return *integralTables;
+        }
+
+        const SourceSpectra& getSpectra(ThreadPool& threadPool) const
+        {
+            std::call_once(spectraFlag, [&] { spectra.emplace(image, threadPool); });
+            return *spectra;
+        }
+
+        // Level 0 is the source itself, every following level halves its size
+        ImageRef getPyramidLevel(int level) const
+        {
+            if (level == 0)
+            {
+                return image;
+            }
+
+            std::lock_guard lock(pyramidMutex);
+            while (static_cast<int>(pyramid.size()) < level)
+            {
+                const auto previous = pyramid.empty() ? image : pyramid.back().image;
+                const Vector2u size(std::max(1u, previous.getSize().x / 2), std::max(1u, previous.getSize().y / 2));
+
+                // Cached levels are used straight from the mapping, which they keep open
+                const auto path = getCachePath("level" + std::to_string(pyramid.size() + 1));
+                if (auto cache = openCache(path))
+                {
+                    if (const auto pixels = cache->getSection<std::uint8_t>(0, static_cast<std::size_t>(size.x) * size.y * 4))
+                    {
+                        pyramid.push_back({ ImageRef(pixels->data(), size), nullptr, std::move(cache) });
+                        continue;
+                    }
+                }
+
+                auto built = std::make_unique<Image>(downsample(previous));
+                pyramid.push_back({ ImageRef(*built), std::move(built), nullptr });
+                if (!path.empty())
+                {
+                    CacheWriter writer;
+                    writer.addSection(std::span<const std::uint8_t>(pyramid.back().image.getPixelsPtr(), static_cast<std::size_t>(size.x) * size.y * 4));
+                    writer.save(path, getDigest());
+                }
+            }
+
+            return pyramid[level - 1].image;
+        }
+
+        // Planes are quick to build from the source, so unlike the rest they aren't cached on disk
+        const PlanarImage& getPlanarImage(int stride) const
+        {
+            std::lock_guard lock(planarImagesMutex);
+            auto& planes = planarImages[stride];
+            if (!planes)
+            {
+                planes = std::make_unique<PlanarImage>(image, stride);
+            }
+            return *planes;
+        }
+
+        const PatchIndex& getPatchIndex(const PatchIndexKey& key, ThreadPool& threadPool) const
+        {
+            PatchIndexEntry* entry{};
+            {
+                std::lock_guard lock(patchIndicesMutex);
+                auto& slot = patchIndices[key];
+                if (!slot)
+                {
+                    slot = std::make_unique<PatchIndexEntry>();
+                }
+                entry = slot.get();
+            }
+
+            std::call_once(entry->flag, [&]
+            {
+                const auto path = getCachePath("index-" + std::to_string(key.blockSize.x) + "x" + std::to_string(key.blockSize.y)
+                    + "-" + std::to_string(key.overlap.x) + "x" + std::to_string(key.overlap.y)
+                    + "-" + std::to_string(static_cast<int>(key.kind)) + "-" + std::to_string(key.dimensions) + "-" + std::to_string(key.stride));
+                if (const auto cache = openCache(path))
+                {
+                    entry->index = PatchIndex::load(image.getSize(), key, cache);
+                }
+
+                if (!entry->index)
+                {
+                    entry->index.emplace(image, getIntegralTables(), key, threadPool);
+                    if (!path.empty())
+                    {
+                        entry->index->save(path, getDigest());
+                    }
+                }
+            });
+            return *entry->index;
+        }
+
+    private:
+        // Digesting reads the whole source, so it's only done once something is looked up in the cache
+        const ImageDigest& getDigest() const
+        {
+            std::call_once(key->flag, [&]
+            {
+                key->digest = digestImage(image);
+
+                std::array<char, 16> digits{};
+                const auto result = std::to_chars(digits.data(), digits.data() + digits.size(), key->digest[0], 16);
+                key->name.assign(digits.data(), result.ptr);
+            });
+            return key->digest;
+        }
+
+        // Empty when there's no cache directory
+        std::filesystem::path getCachePath(const std::string& name) const
+        {
+            if (cacheDirectory.empty())
+            {
+                return {};
+            }
+
+            getDigest();
+            return std::filesystem::path(cacheDirectory) / (key->name + "-" + name + ".bin");
+        }
+
+        std::shared_ptr<const CacheFile> openCache(const std::filesystem::path& path) const
+        {
+            if (path.empty())
+            {
+                return {};
+            }
+
+            auto cache = std::make_shared<const CacheFile>(path);
+            return cache->isValid(getDigest()) ? cache : nullptr;
+        }
+
+        struct PatchIndexEntry
+        {
+            std::once_flag flag;
+            std::optional<PatchIndex> index;
+        };
+
+        // Names the source's cache files, shared by the analyses of the same pixels
+        struct CacheKey
+        {
+            std::once_flag flag;
+            ImageDigest digest{};
+            std::string name;
+        };
+
+        // A level is either built here or viewed in its cache file
+        struct PyramidLevel
+        {
+            ImageRef image;
+            std::unique_ptr<Image> built;
+            std::shared_ptr<const CacheFile> cache;
+        };
+
+        ImageRef image;
+        std::shared_ptr<const Image> ownedImage;
+        std::string cacheDirectory;
+        std::shared_ptr<CacheKey> key;
+
+        mutable std::once_flag opaqueFlag;
+        mutable bool opaque{};
+
+        mutable std::once_flag integralTablesFlag;
+        mutable std::optional<IntegralTables> integralTables;
+
+        mutable std::once_flag spectraFlag;
+        mutable std::optional<SourceSpectra> spectra;
+
+        mutable std::mutex pyramidMutex;
+        mutable std::vector<PyramidLevel> pyramid;
+
+        mutable std::mutex planarImagesMutex;
+        mutable std::map<int, std::unique_ptr<PlanarImage>> planarImages;
+
+        mutable std::mutex patchIndicesMutex;
+        mutable std::map<PatchIndexKey, std::unique_ptr<PatchIndexEntry>> patchIndices;
+    };
+
+    // What selectBestBlockFft builds for every block, the padded planes are as big as the source so they're kept by the caller
+    struct FftSelectionScratch
+    {
+        std::array<std::vector<Fft2d::Complex>, 3> templates;
+        std::vector<Fft2d::Complex> planeScratch;
+        std::vector<TopCandidates> bands;
+        std::vector<TopCandidates::Candidate> candidates;
+    };
+
+    // Computes the squared error of every candidate at once by expanding it as ||a||² + ||b||² - 2a·b,
+    // ||b||² comes from the integral tables and a·b is a correlation of the source with the L shaped overlap
+    template<typename RndEngine>
+    Vector2i selectBestBlockFft(const FftBlockSelection& settings, RndEngine& rngEngine, const SourceAnalysis& source, ThreadPool& threadPool, const Canvas& canvas, Vector2i blockSize, Vector2i blockPos, Vector2i overlap,
+        FftSelectionScratch& fftScratch)
+    {
+        const auto& srcImage = source.getImage();
+        const auto& spectra = source.getSpectra(threadPool);
+        const auto& tables = source.getIntegralTables();
+
+        const auto area = Vector2i(srcImage.getSize()) - blockSize;
+
+        Vector2i topOverlap(blockSize.x, overlap.y);
+        Vector2i leftOverlap(overlap.x, blockSize.y);
+
+        if (blockPos.x == 0)
+        {
+            leftOverlap = {};
+        }
+
+        if (blockPos.y == 0)
+        {
+            topOverlap = {};
+        }
+
+        // The L shaped overlap as two disjoint rectangles, the corner belongs to the top one
+        const std::array<IntRect, 2> overlapRects = { {
+            { {}, topOverlap },
+            { { 0, topOverlap.y }, { leftOverlap.x, std::max(leftOverlap.y - topOverlap.y, 0) } }
+        } };
+
+        const auto fftSize = spectra.fft.getSize();
+        const auto planeSize = static_cast<std::size_t>(fftSize.x) * fftSize.y;
+
+        auto& templates = fftScratch.templates;
+        for (auto& plane : templates)
+        {
+            plane.assign(planeSize, {});
+        }
+        auto& scratch = fftScratch.planeScratch;
+        scratch.resize(planeSize);
+
+        const auto quiltView = canvas.getView(blockPos);
+
+        double templateEnergy = 0.0;
+        int count = 0;
+        for (const auto& rect : overlapRects)
+        {
+            for (int y = rect.position.y; y < rect.position.y + rect.size.y; y++)
+            {
+                for (int x = rect.position.x; x < rect.position.x + rect.size.x; x++)
+                {
+                    const std::uint8_t* color = quiltView.row(y, x);
+                    const float values[3] = { color[0] - fftChannelOffset, color[1] - fftChannelOffset, color[2] - fftChannelOffset };
+                    const auto index = x + static_cast<std::size_t>(y) * fftSize.x;
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        templates[c][index] = values[c];
+                        templateEnergy += values[c] * values[c];
+                    }
+                    count++;
+                }
+            }
+        }
+
+        for (auto& plane : templates)
+        {
+            spectra.fft.forward(plane, scratch, threadPool, blockSize.y);
+        }
+
+        auto& product = templates[0];
+        threadPool.parallelFor(fftSize.x, [&](int row)
+        {
+            const auto begin = static_cast<std::size_t>(row) * fftSize.y;
+            for (auto index = begin; index < begin + fftSize.y; index++)
+            {
+                Fft2d::Complex sum{};
+                for (int c = 0; c < 3; c++)
+                {
+                    sum += std::conj(templates[c][index]) * spectra.channels[c][index];
+                }
+                product[index] = -2.f * sum;
+            }
+        });
+
+        spectra.fft.inverse(product, scratch, threadPool);
+
+        // ||b||² of the centered channels, expanded so the tables of raw values can be used
+        const auto sourceEnergy = [&](Vector2i pos)
+        {
+            double energy = 0.0;
+            for (const auto& rect : overlapRects)
+            {
+                if (rect.size.x <= 0 || rect.size.y <= 0)
+                {
+                    continue;
+                }
+
+                const IntRect srcRect{ pos + rect.position, rect.size };
+                const auto pixelCount = static_cast<double>(rect.size.x) * rect.size.y;
+
+                const auto sum = tables.boxSum(srcRect);
+                energy += static_cast<double>(sum.squares) + 3.0 * fftChannelOffset * fftChannelOffset * pixelCount;
+                for (int c = 0; c < 3; c++)
+                {
+                    energy -= 2.0 * fftChannelOffset * static_cast<double>(sum.sums[c]);
+                }
+            }
+            return energy;
+        };
+
+        const float normalization = 1.f / static_cast<float>(planeSize);
+        const auto candidateCount = area.x * area.y;
+
+        const int bandCount = std::min(threadPool.getThreadCount(), area.y);
+        auto& bands = fftScratch.bands;
+        bands.resize(bandCount);
+        for (auto& band : bands)
+        {
+            band.reset(selectionCount(candidateCount, settings.selectionSpan));
+        }
+
+        threadPool.parallelFor(bandCount, [&](int band)
+        {
+            for (int y = band * area.y / bandCount; y < (band + 1) * area.y / bandCount; y++)
+            {
+                for (int x = 0; x < area.x; x++)
+                {
+                    const auto squaredError = templateEnergy + sourceEnergy({ x, y }) + product[x + static_cast<std::size_t>(y) * fftSize.x].real() * normalization;
+                    const auto meanError = std::sqrt(std::max(squaredError, 0.0) / count);
+                    bands[band].push(static_cast<std::uint32_t>(meanError * 255.0), x + y * area.x);
+                }
+            }
+        });
+
+        const auto selectionIndex = weightedSelection(rngEngine, bands, candidateCount, settings.selectionSpan, fftScratch.candidates);
+        return { selectionIndex % area.x, selectionIndex / area.x };
+    }
+    // What selectIndexedBlock builds for every block
+    struct IndexedSelectionScratch
+    {
+        std::vector<float> descriptor;
+        std::vector<float> projected;
+        std::vector<PatchIndex::Neighbour> neighbours;
+        std::vector<std::uint32_t> distances;
+        std::vector<TopCandidates> bands;
+        std::vector<TopCandidates::Candidate> candidates;
+    };
+
+    // Asks the source's patch index for the candidates whose overlap looks the most like the quilt's
+    template<typename RndEngine>
+    Vector2i selectIndexedBlock(const IndexedBlockSelection& settings, RndEngine& rngEngine, const SourceAnalysis& source, ThreadPool& threadPool, const Canvas& canvas, Vector2i blockSize, Vector2i blockPos, Vector2i overlap,
+        IndexedSelectionScratch& scratch)
+    {
+        const PatchIndexKey key{ blockSize, overlap, getOverlapKind(blockPos), settings.dimensions, settings.indexStride };
+        const auto& index = source.getPatchIndex(key, threadPool);
+
+        auto& descriptor = scratch.descriptor;
+        descriptor.resize(index.getLayout().getSize());
+        index.getLayout().describeQuilt(canvas, blockPos, descriptor.data());
+
+        auto& neighbours = scratch.neighbours;
+        index.query(descriptor.data(), settings.candidateCount, scratch.projected, neighbours);
+
+        auto& distances = scratch.distances;
+        distances.resize(neighbours.size());
+        std::transform(neighbours.begin(), neighbours.end(), distances.begin(), [](const auto& neighbour) { return static_cast<std::uint32_t>(neighbour.distance); });
+
+        const auto selected = weightedSelection(rngEngine, distances.data(), { static_cast<int>(distances.size()), 1 }, 1.f, scratch.bands, scratch.candidates);
+        return index.getPosition(neighbours[selected.x].candidate);
+    }
+    // What selectPyramidBlock builds for every block
+    struct PyramidSelectionScratch
+    {
+        // The quilt's block at full resolution and then at every level
+        std::vector<Image> quiltLevels;
+        std::vector<std::array<int, 4>> rows;
+        OverlapScorer coarseScorer;
+        OverlapScorer scorer;
+        std::vector<TopCandidates> bands;
+        std::vector<TopCandidates::Candidate> survivors;
+        std::vector<Vector2i> positions;
+        std::vector<std::uint32_t> errors;
+        std::vector<TopCandidates::Candidate> candidates;
+    };
+
+    // Scores every candidate on a downsampled copy of the source, then only the surroundings
+    // of the best ones are scored again at full resolution
+    template<typename RndEngine>
+    Vector2i selectPyramidBlock(const PyramidBlockSelection& settings, RndEngine& rngEngine, const SourceAnalysis& source, ThreadPool& threadPool, const Canvas& canvas, Vector2i blockSize, Vector2i blockPos, Vector2i overlap,
+        PyramidSelectionScratch& scratch)
+    {
+        const auto srcImage = source.getImage();
+        const auto coarseImage = source.getPyramidLevel(settings.levels);
+
+        const int factor = 1 << settings.levels;
+        const auto area = Vector2i(srcImage.getSize()) - blockSize;
+
+        auto& quiltLevels = scratch.quiltLevels;
+        quiltLevels.resize(settings.levels + 1);
+        canvas.copyRegion({ blockPos, blockSize }, quiltLevels[0]);
+        for (int level = 0; level < settings.levels; level++)
+        {
+            downsample(quiltLevels[level], quiltLevels[level + 1], scratch.rows);
+        }
+        const auto& quiltBlock = quiltLevels[settings.levels];
+
+        const Vector2i coarseBlockSize(quiltBlock.getSize());
+        const Vector2i coarseOverlap(std::max(1, overlap.x / factor), std::max(1, overlap.y / factor));
+        const Vector2i coarseArea(std::max(1, area.x / factor), std::max(1, area.y / factor));
+
+        scratch.coarseScorer.reset(PixelView(quiltBlock), coarseBlockSize, coarseOverlap, blockPos);
+        auto& bands = scratch.bands;
+        scoreCandidateGrid(threadPool, scratch.coarseScorer, coarseImage, nullptr, nullptr, coarseArea, 1, settings.survivorCount, bands);
+
+        auto& survivors = scratch.survivors;
+        survivors.clear();
+        for (const auto& band : bands)
+        {
+            survivors.insert(survivors.end(), band.getCandidates().begin(), band.getCandidates().end());
+        }
+
+        const auto survivorCount = std::min<std::size_t>(settings.survivorCount, survivors.size());
+        std::nth_element(survivors.begin(), survivors.begin() + (survivorCount - 1), survivors.end());
+        survivors.resize(survivorCount);
+        std::sort(survivors.begin(), survivors.end());
+
+        // Each survivor stands for the factor x factor full resolution positions it was downsampled from. When the search area is
+        // smaller than that the cells reach past it, those positions aren't candidates
+        auto& positions = scratch.positions;
+        positions.clear();
+        for (const auto& survivor : survivors)
+        {
+            const auto origin = Vector2i(survivor.index % coarseArea.x, survivor.index / coarseArea.x) * factor;
+            for (int y = 0; y < factor; y++)
+            {
+                for (int x = 0; x < factor; x++)
+                {
+                    const auto pos = origin + Vector2i(x, y);
+                    if (pos.x < area.x && pos.y < area.y)
+                    {
+                        positions.push_back(pos);
+                    }
+                }
+            }
+        }
+
+        auto& scorer = scratch.scorer;
+        scorer.reset(canvas.getView(blockPos), blockSize, overlap, blockPos);
+
+        auto& errors = scratch.errors;
+        errors.resize(positions.size());
+        threadPool.parallelFor(static_cast<int>(positions.size()), [&](int candidate)
+        {
+            errors[candidate] = scorer(PixelView(srcImage, positions[candidate]));
+        });
+
+        const auto selected = weightedSelection(rngEngine, errors.data(), { static_cast<int>(positions.size()), 1 }, settings.selectionSpan, bands, scratch.candidates);
+        return positions[selected.x];
+    }
+
+    // Same values as std::seed_seq, which keeps its seeds in a vector and would allocate for every block, for a fixed number of seeds
+    template<std::size_t Count>
+    class FixedSeedSequence
+    {
+    public:
+        using result_type = std::uint32_t;
+
+        explicit FixedSeedSequence(const std::array<std::uint32_t, Count>& values) : values(values)
+        {
+        }
+
+        std::size_t size() const
+        {
+            return Count;
+        }
+
+        template<typename Iterator>
+        void generate(Iterator begin, Iterator end) const
+        {
+            if (begin == end)
+            {
+                return;
+            }
+
+            const auto n = static_cast<std::size_t>(end - begin);
+            std::fill(begin, end, 0x8b8b8b8bu);
+
+            const std::size_t t = n >= 623 ? 11 : n >= 68 ? 7 : n >= 39 ? 5 : n >= 7 ? 3 : (n - 1) / 2;
+            const std::size_t p = (n - t) / 2;
+            const std::size_t q = p + t;
+            const std::size_t m = std::max(Count + 1, n);
+
+            const auto at = [&](std::size_t k) { return static_cast<std::uint32_t>(begin[k % n]); };
+            const auto mix = [](std::uint32_t x) { return x ^ (x >> 27); };
+
+            for (std::size_t k = 0; k < m; k++)
+            {
+                const std::uint32_t r1 = 1664525u * mix(at(k) ^ at(k + p) ^ at(k + n - 1));
+                const std::uint32_t r2 = r1 + static_cast<std::uint32_t>(k == 0 ? Count : k <= Count ? k % n + values[k - 1] : k % n);
+                begin[(k + p) % n] = at(k + p) + r1;
+                begin[(k + q) % n] = at(k + q) + r2;
+                begin[k % n] = r2;
+            }
+
+            for (std::size_t k = m; k < m + n; k++)
+            {
+                const std::uint32_t r3 = 1566083941u * mix(at(k) + at(k + p) + at(k + n - 1));
+                const std::uint32_t r4 = r3 - static_cast<std::uint32_t>(k % n);
+                begin[(k + p) % n] = at(k + p) ^ r3;
+                begin[(k + q) % n] = at(k + q) ^ r4;
+                begin[k % n] = r4;
+            }
+        }
+
+    private:
+        std::array<std::uint32_t, Count> values;
+    };
+
+    // Everything placing a block builds, pooled by quilt() so that once each block being placed at the same
+    // time has its own, blocks reuse storage instead of allocating
+    struct BlockScratch
+    {
+        Image blockImage;
+        CpuSelectionScratch selection;
+        FftSelectionScratch fftSelection;
+        IndexedSelectionScratch indexedSelection;
+        PyramidSelectionScratch pyramidSelection;
+        FeatherScratch feather;
+        std::array<std::vector<float>, 2> differences;
+        SeamCosts leftCosts;
+        SeamCosts topCosts;
+        MaxFlow maxFlow;
+        BlockCut cut;
+        std::vector<Color> seamColors;
+    };
+
+    bool areSettingsValid(Vector2u sourceSize, const Settings& settings)
+    {
+        const auto overlap = settings.overlap;
+        const auto blockSize = settings.blockSize;
+        const auto quiltSize = settings.quiltSize;
+
+        if (blockSize.x <= 0 || blockSize.y <= 0)
+        {
+            return false;
+        }
+
+        if (overlap.x <= 0 || overlap.y <= 0 || overlap.x >= blockSize.x || overlap.y >= blockSize.y)
+        {
+            return false;
+        }
+
+        if (quiltSize.x < 1 || quiltSize.y < 1)
+        {
+            return false;
+        }
+
+        if (settings.makeTileable && (quiltSize.x < 2 || quiltSize.y < 2))
+        {
+            return false;
+        }
+
+        if (blockSize.x >= sourceSize.x || blockSize.y >= sourceSize.y)
+        {
+            return false;
+        }
+
+        if (auto* select = std::get_if<WeightedBlockSelection>(&settings.blockSelection))
+        {
+            if (select->searchStride < 1)
+            {
+                return false;
+            }
+        }
+
+        if (auto* select = std::get_if<IndexedBlockSelection>(&settings.blockSelection))
+        {
+            if (select->candidateCount < 1 || select->dimensions < 1 || select->indexStride < 1)
+            {
+                return false;
+            }
+        }
+
+        if (auto* select = std::get_if<PyramidBlockSelection>(&settings.blockSelection))
+        {
+            // Blocks have to keep a pixel on the coarsest level, which is only worked out once the shifts are known to be in range
+            if (select->levels < 0 || select->levels > 15 || select->survivorCount < 1)
+            {
+                return false;
+            }
+
+            if ((blockSize.x >> select->levels) < 1 || (blockSize.y >> select->levels) < 1)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    int getBytesPerPixel(PixelFormat format)
+    {
+        if (format == PixelFormat::Gray)
+        {
+            return 1;
+        }
+
+        return format == PixelFormat::Rgb ? 3 : 4;
+    }
+
+    template<typename View>
+    bool isViewValid(const View& view)
+    {
+        return view.data && view.width > 0 && view.height > 0 && view.stride >= static_cast<std::size_t>(view.width) * getBytesPerPixel(view.format);
+    }
+
+    bool isPacked(const ImageView& view)
+    {
+        return view.format == PixelFormat::Rgba && view.stride == static_cast<std::size_t>(view.width) * 4;
+    }
+
+    // Everything inside works on packed RGBA pixels, views in any other layout are converted into an image
+    Image toImage(const ImageView& view)
+    {
+        Image image(Vector2u(view.width, view.height));
+        const auto rowSize = static_cast<std::size_t>(view.width) * 4;
+        std::uint8_t* pixels = image.getPixelsPtr();
+        const int bytesPerPixel = getBytesPerPixel(view.format);
+        for (unsigned int y = 0; y < view.height; y++)
+        {
+            const std::uint8_t* source = view.data + y * view.stride;
+            std::uint8_t* pixel = &pixels[y * rowSize];
+            if (view.format == PixelFormat::Rgba)
+            {
+                std::memcpy(pixel, source, rowSize);
+                continue;
+            }
+
+            for (unsigned int x = 0; x < view.width; x++, source += bytesPerPixel, pixel += 4)
+            {
+                if (view.format == PixelFormat::Gray)
+                {
+                    pixel[0] = pixel[1] = pixel[2] = source[0];
+                    pixel[3] = 255;
+                }
+                else if (view.format == PixelFormat::Rgb)
+                {
+                    std::memcpy(pixel, source, 3);
+                    pixel[3] = 255;
+                }
+                else
+                {
+                    pixel[0] = source[2];
+                    pixel[1] = source[1];
+                    pixel[2] = source[0];
+                    pixel[3] = source[3];
+                }
+            }
+        }
+
+        return image;
+    }
+
+    // Packed RGBA sources are read in place, the analysis keeps the converted copy of any other
+    std::unique_ptr<const SourceAnalysis> analyseSource(const ImageView& view, const std::string& cacheDirectory)
+    {
+        if (isPacked(view))
+        {
+            return std::make_unique<const SourceAnalysis>(ImageRef(view.data, Vector2u(view.width, view.height)), nullptr, cacheDirectory);
+        }
+
+        auto image = std::make_shared<const Image>(toImage(view));
+        return std::make_unique<const SourceAnalysis>(ImageRef(*image), image, cacheDirectory);
+    }
+
+    // Writes the view sized part of the image starting at `position`
+    void writeImage(const ImageRef& image, Vector2u position, const MutableImageView& view)
+    {
+        const auto imageRowSize = static_cast<std::size_t>(image.getSize().x) * 4;
+        const auto rowSize = static_cast<std::size_t>(view.width) * 4;
+        const int bytesPerPixel = getBytesPerPixel(view.format);
+        for (unsigned int y = 0; y < view.height; y++)
+        {
+            const std::uint8_t* pixel = image.getPixelsPtr() + (position.y + y) * imageRowSize + static_cast<std::size_t>(position.x) * 4;
+            std::uint8_t* destination = view.data + y * view.stride;
+            if (view.format == PixelFormat::Rgba)
+            {
+                std::memcpy(destination, pixel, rowSize);
+                continue;
+            }
+
+            for (unsigned int x = 0; x < view.width; x++, pixel += 4, destination += bytesPerPixel)
+            {
+                if (view.format == PixelFormat::Gray)
+                {
+                    destination[0] = static_cast<std::uint8_t>((pixel[0] * 299 + pixel[1] * 587 + pixel[2] * 114 + 500) / 1000);
+                }
+                else if (view.format == PixelFormat::Rgb)
+                {
+                    std::memcpy(destination, pixel, 3);
+                }
+                else
+                {
+                    destination[0] = pixel[2];
+                    destination[1] = pixel[1];
+                    destination[2] = pixel[0];
+                    destination[3] = pixel[3];
+                }
+            }
+        }
+    }
+
+    // A plan can come from anywhere, only one whose blocks all fit in the source and its own geometry is drawn
+    bool isPlanValid(const ImageRef& sourceImage, const QuiltPlan& plan)
+    {
+        Settings geometry;
+        geometry.blockSize = plan.blockSize;
+        geometry.overlap = plan.overlap;
+        geometry.quiltSize = plan.quiltSize;
+        geometry.makeTileable = plan.makeTileable;
+        if (!areSettingsValid(sourceImage.getSize(), geometry))
+        {
+            return false;
+        }
+
+        const auto blockSize = plan.blockSize;
+        const auto maxSourcePos = Vector2i(sourceImage.getSize()) - blockSize;
+        if (plan.blocks.size() != static_cast<std::size_t>(plan.quiltSize.x) * plan.quiltSize.y)
+        {
+            return false;
+        }
+
+        for (std::size_t i = 0; i < plan.blocks.size(); i++)
+        {
+            const auto& block = plan.blocks[i];
+            if (block.sourcePos.x < 0 || block.sourcePos.y < 0 || block.sourcePos.x > maxSourcePos.x || block.sourcePos.y > maxSourcePos.y)
+            {
+                return false;
+            }
+
+            // Only the first block has nothing to overlap
+            if (i == 0)
+            {
+                continue;
+            }
+
+            if (block.rowEnds.size() != static_cast<std::size_t>(blockSize.y) || block.columnEnds.size() != static_cast<std::size_t>(blockSize.x))
+            {
+                return false;
+            }
+
+            if (std::any_of(block.rowEnds.begin(), block.rowEnds.end(), [&](int end) { return end < 0 || end > blockSize.x; }) ||
+                std::any_of(block.columnEnds.begin(), block.columnEnds.end(), [&](int end) { return end < 0 || end > blockSize.y; }))
+            {
+                return false;
+            }
+
+            if (std::any_of(block.seam.begin(), block.seam.end(), [&](Vector2i pos) { return pos.x < 0 || pos.y < 0 || pos.x >= blockSize.x || pos.y >= blockSize.y; }))
+            {
+                return false;
+            }
+
+            if (!block.cleared.empty() && block.cleared.size() != static_cast<std::size_t>(blockSize.x) * blockSize.y)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Plans are stored as unsigned LEB128 varints, so the small numbers they're made of mostly take a byte each
+    void writeVarint(std::vector<std::uint8_t>& data, std::uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            data.push_back(static_cast<std::uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        data.push_back(static_cast<std::uint8_t>(value));
+    }
+
+    // Reads what writeVarint wrote, anything past the end or that doesn't fit in an int fails every later read
+    class PlanReader
+    {
+    public:
+        explicit PlanReader(std::span<const std::uint8_t> data) : data(data)
+        {
+        }
+
+        std::uint8_t readByte()
+        {
+            if (data.empty())
+            {
+                failed = true;
+                return 0;
+            }
+
+            const auto byte = data.front();
+            data = data.subspan(1);
+            return byte;
+        }
+
+        int readInt()
+        {
+            std::uint64_t value = 0;
+            for (int shift = 0; !failed; shift += 7)
+            {
+                const auto byte = readByte();
+                value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                {
+                    break;
+                }
+
+                if (shift >= 28)
+                {
+                    failed = true;
+                }
+            }
+
+            if (failed || value > static_cast<std::uint64_t>(std::numeric_limits<int>::max()))
+            {
+                failed = true;
+                return 0;
+            }
+
+            return static_cast<int>(value);
+        }
+
+        // A count of items that take at least `minBytes` each, so a corrupt count can't ask for more than the data holds
+        std::size_t readCount(std::size_t minBytes = 1)
+        {
+            const auto count = static_cast<std::size_t>(readInt());
+            if (count > data.size() / minBytes)
+            {
+                failed = true;
+                return 0;
+            }
+
+            return count;
+        }
+
+        // The same for bits packed eight to a byte
+        std::size_t readBitCount()
+        {
+            const auto count = static_cast<std::size_t>(readInt());
+            if ((count + 7) / 8 > data.size())
+            {
+                failed = true;
+                return 0;
+            }
+
+            return count;
+        }
+
+        bool isDone() const
+        {
+            return !failed && data.empty();
+        }
+
+        bool hasFailed() const
+        {
+            return failed;
+        }
+
+    private:
+        std::span<const std::uint8_t> data;
+        bool failed = false;
+    };
+
+    constexpr std::array<std::uint8_t, 4> planMagic{ 'Q', 'L', 'T', 'P' };
+    constexpr int planVersion = 1;
+}
+
+std::vector<std::uint8_t> QuiltPlan::serialize() const
+{
+    std::vector<std::uint8_t> data(planMagic.begin(), planMagic.end());
+    writeVarint(data, planVersion);
+
+    for (const auto vector : { blockSize, overlap, quiltSize })
+    {
+        writeVarint(data, vector.x);
+        writeVarint(data, vector.y);
+    }
+    data.push_back(makeTileable);
+
+    writeVarint(data, static_cast<std::uint32_t>(blocks.size()));
+    for (const auto& block : blocks)
+    {
+        writeVarint(data, block.sourcePos.x);
+        writeVarint(data, block.sourcePos.y);
+
+        for (const auto* ends : { &block.rowEnds, &block.columnEnds })
+        {
+            writeVarint(data, static_cast<std::uint32_t>(ends->size()));
+            for (const auto end : *ends)
+            {
+                writeVarint(data, end);
+            }
+        }
+
+        writeVarint(data, static_cast<std::uint32_t>(block.seam.size()));
+        for (const auto pos : block.seam)
+        {
+            writeVarint(data, pos.x);
+            writeVarint(data, pos.y);
+        }
+
+        // Cleared pixels are packed eight to a byte
+        writeVarint(data, static_cast<std::uint32_t>(block.cleared.size()));
+        for (std::size_t i = 0; i < block.cleared.size(); i += 8)
+        {
+            std::uint8_t bits = 0;
+            for (std::size_t bit = 0; bit < 8 && i + bit < block.cleared.size(); bit++)
+            {
+                bits |= (block.cleared[i + bit] ? 1 : 0) << bit;
+            }
+            data.push_back(bits);
+        }
+    }
+
+    return data;
+}
+
+std::optional<QuiltPlan> QuiltPlan::deserialize(std::span<const std::uint8_t> data)
+{
+    if (data.size() < planMagic.size() || !std::equal(planMagic.begin(), planMagic.end(), data.begin()))
+    {
+        return {};
+    }
+
+    PlanReader reader(data.subspan(planMagic.size()));
+    if (reader.readInt() != planVersion)
+    {
+        return {};
+    }
+
+    QuiltPlan plan;
+    for (auto* vector : { &plan.blockSize, &plan.overlap, &plan.quiltSize })
+    {
+        vector->x = reader.readInt();
+        vector->y = reader.readInt();
+    }
+    plan.makeTileable = reader.readByte() != 0;
 
-    if (blockSize.x <= 0 || blockSize.y <= 0)
+    // Even the first block takes six bytes, its position and four empty counts
+    plan.blocks.resize(reader.readCount(6));
+    for (auto& block : plan.blocks)
+    {
+        block.sourcePos.x = reader.readInt();
+        block.sourcePos.y = reader.readInt();
+
+        for (auto* ends : { &block.rowEnds, &block.columnEnds })
+        {
+            ends->resize(reader.readCount());
+            for (auto& end : *ends)
+            {
+                end = reader.readInt();
+            }
+        }
+
+        block.seam.resize(reader.readCount(2));
+        for (auto& pos : block.seam)
+        {
+            pos.x = reader.readInt();
+            pos.y = reader.readInt();
+        }
+
+        block.cleared.resize(reader.readBitCount());
+        for (std::size_t i = 0; i < block.cleared.size(); i += 8)
+        {
+            const auto bits = reader.readByte();
+            for (std::size_t bit = 0; bit < 8 && i + bit < block.cleared.size(); bit++)
+            {
+                block.cleared[i + bit] = (bits >> bit) & 1;
+            }
+        }
+
+        if (reader.hasFailed())
+        {
+            return {};
+        }
+    }
+
+    if (!reader.isDone())
     {
         return {};
     }
 
-    if (overlap.x <= 0 || overlap.y <= 0 || overlap.x >= blockSize.x || overlap.y >= blockSize.y)
+    return plan;
+}
+
+struct Quilter::State
+{
+    std::unique_ptr<const SourceAnalysis> source;
+#if !defined(QUILTIS_NO_GPU)
+    std::optional<sf::Texture> sourceTexture;
+#endif
+    std::unique_ptr<ThreadPool> threadPool;
+
+    // Scratch space is reused between blocks, one per block being placed at the same time
+    std::mutex scratchesMutex;
+    std::vector<std::unique_ptr<BlockScratch>> scratches;
+};
+
+Quilter::Quilter() : state(std::make_unique<State>())
+{
+}
+
+Quilter::Quilter(const ImageView& sourceImage) : Quilter()
+{
+    state->source = analyseSource(sourceImage, std::string());
+}
+
+Quilter::~Quilter() = default;
+
+Quilter::Quilter(Quilter&&) noexcept = default;
+Quilter& Quilter::operator=(Quilter&&) noexcept = default;
+
+// A one off Quilter with an analysis of its own, reusing one across calls is what a Quilter is for
+Image quilt(const ImageView& sourceImage, const Settings& settings)
+{
+    if (!isViewValid(sourceImage) || !areSettingsValid(Vector2u(sourceImage.width, sourceImage.height), settings))
     {
         return {};
     }
 
-    if (quiltSize.x < 1 || quiltSize.y < 1)
+    Quilter quilter;
+    quilter.state->source = analyseSource(sourceImage, settings.cacheDirectory);
+    return quilter.quilt(settings);
+}
+
+QuiltPlan plan(const ImageView& sourceImage, const Settings& settings)
+{
+    if (!isViewValid(sourceImage) || !areSettingsValid(Vector2u(sourceImage.width, sourceImage.height), settings))
     {
         return {};
     }
 
-    if (settings.makeTileable && (quiltSize.x < 2 || quiltSize.y < 2))
+    Quilter quilter;
+    quilter.state->source = analyseSource(sourceImage, settings.cacheDirectory);
+    return quilter.plan(settings);
+}
+
+Vector2u getQuiltSize(const Settings& settings)
+{
+    const auto size = settings.quiltSize.componentWiseMul(settings.blockSize - settings.overlap) + settings.overlap;
+    return Vector2u(settings.makeTileable ? size - settings.blockSize : size);
+}
+
+bool quilt(const ImageView& sourceImage, const Settings& settings, const MutableImageView& quiltImage)
+{
+    if (!isViewValid(sourceImage) || !areSettingsValid(Vector2u(sourceImage.width, sourceImage.height), settings))
+    {
+        return false;
+    }
+
+    Quilter quilter;
+    quilter.state->source = analyseSource(sourceImage, settings.cacheDirectory);
+    return quilter.quilt(settings, quiltImage);
+}
+
+std::vector<Image> quiltBatch(const ImageView& sourceImage, const Settings& settings, std::span<const int> seeds)
+{
+    if (!isViewValid(sourceImage) || !areSettingsValid(Vector2u(sourceImage.width, sourceImage.height), settings))
+    {
+        return std::vector<Image>(seeds.size());
+    }
+
+    Quilter quilter;
+    quilter.state->source = analyseSource(sourceImage, settings.cacheDirectory);
+    return quilter.quiltBatch(settings, seeds);
+}
+
+Image render(const QuiltPlan& plan, const ImageView& sourceImage, const Settings& settings)
+{
+    if (!isViewValid(sourceImage))
     {
         return {};
     }
 
-    if (blockSize.x >= sourceImage.getSize().x || blockSize.y >= sourceImage.getSize().y)
+    Quilter quilter;
+    quilter.state->source = analyseSource(sourceImage, settings.cacheDirectory);
+    return quilter.render(plan, settings);
+}
+
+Image Quilter::quilt(const Settings& settings)
+{
+    if (!areSettingsValid(state->source->getImage().getSize(), settings))
     {
         return {};
     }
 
-    if (auto* select = std::get_if<WeightedBlockSelection>(&settings.blockSelection))
+    prepare(settings, false);
+    return synthesize(settings, nullptr, nullptr, nullptr);
+}
+
+bool Quilter::quilt(const Settings& settings, const MutableImageView& quiltImage)
+{
+    if (!areSettingsValid(state->source->getImage().getSize(), settings) || !isViewValid(quiltImage) || Vector2u(quiltImage.width, quiltImage.height) != getQuiltSize(settings))
+    {
+        return false;
+    }
+
+    prepare(settings, false);
+    synthesize(settings, nullptr, nullptr, &quiltImage);
+    return true;
+}
+
+std::vector<Image> Quilter::quiltBatch(const Settings& settings, std::span<const int> seeds)
+{
+    std::vector<Image> images(seeds.size());
+    if (!areSettingsValid(state->source->getImage().getSize(), settings))
+    {
+        return images;
+    }
+
+    prepare(settings, false);
+
+    const auto synthesizeVariant = [&](int index)
+    {
+        auto variantSettings = settings;
+        variantSettings.seed = seeds[index];
+        images[index] = synthesize(variantSettings, nullptr, nullptr, nullptr);
+    };
+
+    // Variants are spread over the pool and the work inside each goes to whichever threads are left.
+    // GPU selection is locked to one thread at a time anyway, so variants using it are made one after the other
+    if (usesGpu(settings))
     {
-        if (select->searchStride < 1)
+        for (int index = 0; index < static_cast<int>(seeds.size()); index++)
         {
-            return {};
+            synthesizeVariant(index);
         }
     }
+    else
+    {
+        state->threadPool->parallelFor(static_cast<int>(seeds.size()), synthesizeVariant);
+    }
+
+    return images;
+}
+
+QuiltPlan Quilter::plan(const Settings& settings)
+{
+    QuiltPlan plan;
+    if (areSettingsValid(state->source->getImage().getSize(), settings))
+    {
+        prepare(settings, false);
+        synthesize(settings, nullptr, &plan, nullptr);
+    }
+
+    return plan;
+}
+
+Image Quilter::render(const QuiltPlan& plan, const Settings& settings)
+{
+    if (!isPlanValid(state->source->getImage(), plan))
+    {
+        return {};
+    }
+
+    auto renderSettings = settings;
+    renderSettings.blockSize = plan.blockSize;
+    renderSettings.overlap = plan.overlap;
+    renderSettings.quiltSize = plan.quiltSize;
+    renderSettings.makeTileable = plan.makeTileable;
+    prepare(renderSettings, true);
+    return synthesize(renderSettings, &plan, nullptr, nullptr);
+}
+
+void Quilter::prepare(const Settings& settings, bool isReplay)
+{
+    // The analysis is tied to where it's cached, a different directory starts over from the same source.
+    // Replaying a plan only draws, it doesn't need anything the cache holds
+    if (!isReplay && state->source->getCacheDirectory() != settings.cacheDirectory)
+    {
+        state->source = std::make_unique<const SourceAnalysis>(*state->source, settings.cacheDirectory);
+    }
 
-    sf::Texture sourceTexture(sf::Vector2u{1, 1});
-    if (settings.useGpuAcceleration)
+#if !defined(QUILTIS_NO_GPU)
+    if (usesGpu(settings) && !isReplay && !state->sourceTexture)
     {
-        sourceTexture.loadFromImage(sourceImage);
-        sourceTexture.setSmooth(0);
+        const auto sourceImage = state->source->getImage();
+        state->sourceTexture.emplace(sf::Vector2u(sourceImage.getSize().x, sourceImage.getSize().y));
+        state->sourceTexture->update(sourceImage.getPixelsPtr());
+        state->sourceTexture->setSmooth(0);
     }
+#endif
 
-    sf::Image quiltImage;
-    quiltImage.resize(sf::Vector2u(quiltSize.componentWiseMul(blockSize - overlap) + overlap));
+    const int threadCount = std::max(settings.threadCount > 0 ? settings.threadCount : static_cast<int>(std::thread::hardware_concurrency()), 1);
+    if (!state->threadPool || state->threadPool->getThreadCount() != threadCount)
+    {
+        state->threadPool.reset();
+        state->threadPool = std::make_unique<ThreadPool>(threadCount);
+    }
+}
+
+Image Quilter::synthesize(const Settings& settings, const QuiltPlan* replay, QuiltPlan* record, const MutableImageView* output)
+{
+    const auto& source = state->source;
+    const auto sourceImage = source->getImage();
+
+    const auto overlap = settings.overlap;
+    const auto blockSize = settings.blockSize;
+    const auto quiltSize = settings.quiltSize;
+
+    if (record)
+    {
+        record->blockSize = blockSize;
+        record->overlap = overlap;
+        record->quiltSize = quiltSize;
+        record->makeTileable = settings.makeTileable;
+        record->blocks.assign(static_cast<std::size_t>(quiltSize.x) * quiltSize.y, {});
+    }
+
+    auto& threadPool = *state->threadPool;
+    const auto seamBlending = getSeamBlending(settings);
+
+    // RGBA views get drawn into directly, the image in between is only kept to convert formats or crop tileable quilts
+    const Vector2u canvasSize(quiltSize.componentWiseMul(blockSize - overlap) + overlap);
+    const bool isDirect = output && output->format == PixelFormat::Rgba && !settings.makeTileable;
+
+    Image quiltImage;
+    if (isDirect)
+    {
+        // Starting from the same opaque black a new image has
+        for (unsigned int y = 0; y < output->height; y++)
+        {
+            std::uint8_t* pixel = output->data + y * output->stride;
+            for (unsigned int x = 0; x < output->width; x++, pixel += 4)
+            {
+                pixel[0] = pixel[1] = pixel[2] = 0;
+                pixel[3] = 255;
+            }
+        }
+    }
+    else
+    {
+        quiltImage = Image(canvasSize);
+    }
+
+    auto canvas = isDirect ? Canvas(output->data, canvasSize, output->stride) : Canvas(quiltImage);
 
-    sf::Image seamsImage;
+    // Seam pixels are drawn over the finished quilt, until then they're kept as one bit per quilt pixel.
+    // Blocks placed at the same time can have bits in the same word, so those are set atomically
+    std::vector<std::uint64_t> seamMask;
     if (settings.showSeams)
     {
-        seamsImage.resize(quiltImage.getSize(), sf::Color::Transparent);
+        seamMask.resize((static_cast<std::size_t>(canvas.getSize().x) * canvas.getSize().y + 63) / 64);
     }
 
-    const bool needSources = settings.makeTileable;
+    // Only the vectorised CPU search scores candidates in batches from the source's planes
+    const PlanarImage* sourcePlanes = nullptr;
+#if defined(__AVX2__)
+    if (const auto* select = std::get_if<WeightedBlockSelection>(&settings.blockSelection); select && !usesGpu(settings) && !replay)
+    {
+        sourcePlanes = &source->getPlanarImage(select->searchStride);
+    }
+#endif
+
+    // Blocks of an opaque source replace what they land on, nothing has to be blended
+    const bool isSourceOpaque = source->isOpaque();
+
+    const bool needSources = settings.makeTileable && !replay;
 
-    std::vector<sf::Vector2i> blockSources;
+    std::vector<Vector2i> blockSources;
     if (needSources)
     {
-        blockSources.reserve(quiltSize.x * quiltSize.y);
+        blockSources.resize(quiltSize.x * quiltSize.y);
     }
 
-    std::default_random_engine rng(settings.seed);
+    // The block each quilt pixel was mostly taken from, seams are wherever it changes
+    std::vector<int> blockIds;
+    if (seamBlending == SeamBlending::Poisson)
+    {
+        blockIds.resize(canvas.getSize().x * canvas.getSize().y);
+    }
 
-    for (int y = 0; y < quiltSize.y; y++)
+#if !defined(QUILTIS_NO_GPU)
+    // SFML's GL resources can't be driven from several threads at once
+    std::mutex gpuMutex;
+#endif
+
+    const auto placeBlock = [&](int x, int y, BlockScratch& scratch)
     {
-        for (int x = 0; x < quiltSize.x; x++)
+        // Every block gets its own engine so the result doesn't depend on the order blocks are placed in
+        FixedSeedSequence<3> seedSequence({ static_cast<std::uint32_t>(settings.seed), static_cast<std::uint32_t>(x), static_cast<std::uint32_t>(y) });
+        std::default_random_engine rng(seedSequence);
+
+        const auto blockPos = (blockSize - overlap).componentWiseMul({ x, y });
+        const int blockId = x + y * quiltSize.x;
+
+        Vector2i srcPos{};
+        if (replay)
+        {
+            srcPos = replay->blocks[blockId].sourcePos;
+        }
+        else if (settings.makeTileable && (x == quiltSize.x - 1 || y == quiltSize.y - 1))
+        {
+            if (x == quiltSize.x - 1)
+            {
+                srcPos = blockSources[y * quiltSize.x];
+            }
+            else
+            {
+                srcPos = blockSources[x];
+            }
+        }
+        else if ((x == 0 && y == 0) || std::get_if<RandomBlockSelection>(&settings.blockSelection))
+        {
+            srcPos = selectRandomBlock(rng, sourceImage, blockSize);
+        }
+        else if (auto* select = std::get_if<WeightedBlockSelection>(&settings.blockSelection))
+        {
+#if !defined(QUILTIS_NO_GPU)
+            if (settings.useGpuAcceleration)
+            {
+                std::lock_guard lock(gpuMutex);
+                srcPos = selectBestBlockGpu(*select, rng, *state->sourceTexture, canvas, blockSize, blockPos, overlap);
+            }
+            else
+#endif
+            {
+                srcPos = selectBestBlockCpu(*select, rng, threadPool, source->getIntegralTables(), sourceImage, sourcePlanes, canvas, blockSize, blockPos, overlap, scratch.selection);
+            }
+        }
+        else if (auto* select = std::get_if<FftBlockSelection>(&settings.blockSelection))
+        {
+            srcPos = selectBestBlockFft(*select, rng, *source, threadPool, canvas, blockSize, blockPos, overlap, scratch.fftSelection);
+        }
+        else if (auto* select = std::get_if<IndexedBlockSelection>(&settings.blockSelection))
+        {
+            srcPos = selectIndexedBlock(*select, rng, *source, threadPool, canvas, blockSize, blockPos, overlap, scratch.indexedSelection);
+        }
+        else if (auto* select = std::get_if<PyramidBlockSelection>(&settings.blockSelection))
+        {
+            srcPos = selectPyramidBlock(*select, rng, *source, threadPool, canvas, blockSize, blockPos, overlap, scratch.pyramidSelection);
+        }
+
+        if (needSources)
+        {
+            blockSources[blockId] = srcPos;
+        }
+
+        if (record)
+        {
+            record->blocks[blockId].sourcePos = srcPos;
+        }
+
+        // Opaque blocks go straight from the source into the quilt, along the runs of each row their cut keeps. The block image is
+        // only made when its pixels have to be painted over or blended in
+        const bool isFeathered = settings.doCut && seamBlending == SeamBlending::Feather && settings.featherWidth > 0;
+        const bool needBlockImage = !isSourceOpaque || settings.showDifference || isFeathered;
+
+        // Every pixel of the block image is overwritten, it only has to be made again when the block size changes
+        auto& blockImage = scratch.blockImage;
+        if (needBlockImage)
+        {
+            fitImage(blockImage, Vector2u(blockSize));
+            Canvas(blockImage).copy(PixelView(sourceImage, srcPos), {}, blockSize);
+        }
+
+        auto& cut = scratch.cut;
+        bool isCut = false;
+        auto& seamColors = scratch.seamColors;
+        seamColors.clear();
+
+        // The left and top overlaps are compared and cut as one L shaped region, so the corner is only handled once
+        if (blockPos.x > 0 || blockPos.y > 0)
         {
-            const auto blockPos = (blockSize - overlap).componentWiseMul({ x, y });
+            const auto kind = getOverlapKind(blockPos);
+            const int topHeight = kind != OverlapKind::Left ? overlap.y : 0;
+            const IntRect topRect{ {}, { blockSize.x, topHeight } };
+            const IntRect leftRect{ { 0, topHeight }, { kind != OverlapKind::Top ? overlap.x : 0, blockSize.y - topHeight } };
 
-            sf::Vector2i srcPos{};
-            if (settings.makeTileable && (x == quiltSize.x - 1 || y == quiltSize.y - 1))
+            // A replayed cut is already known, the differences are only needed to be shown
+            auto& differences = scratch.differences;
+            const std::array<IntRect, 2> rects = { topRect, leftRect };
+            for (int x = 0; x < 2 && (!replay || settings.showDifference); x++)
             {
-                if (x == quiltSize.x - 1)
+                if (rects[x].size.x > 0 && rects[x].size.y > 0)
                 {
-                    srcPos = blockSources[y * quiltSize.x];
+                    imageDifference(canvas.getView(blockPos + rects[x].position), PixelView(sourceImage, srcPos + rects[x].position), rects[x].size, differences[x]);
                 }
                 else
                 {
-                    srcPos = blockSources[x];
+                    differences[x].clear();
+                }
+            }
+
+            if (settings.showDifference)
+            {
+                float maxDifference = 0.f;
+                for (const auto& difference : differences)
+                {
+                    for (const auto diff : difference)
+                    {
+                        maxDifference = std::max(maxDifference, diff);
+                    }
+                }
+
+                for (int x = 0; x < 2; x++)
+                {
+                    for (int i = 0; i < static_cast<int>(differences[x].size()); i++)
+                    {
+                        const auto diff = differences[x][i] / maxDifference;
+                        const auto color = Color(255 * diff, 255 * diff, 255 * diff, 255);
+                        const auto pos = Vector2u(rects[x].position + Vector2i(i % rects[x].size.x, i / rects[x].size.x));
+                        setPixel(blockImage, pos, color);
+                    }
                 }
             }
-            else if ((x == 0 && y == 0) || std::get_if<RandomBlockSelection>(&settings.blockSelection))
+
+            if (replay)
             {
-                srcPos = selectRandomBlock(rng, sourceImage, blockSize);
+                const auto& block = replay->blocks[blockId];
+                cut.rowEnds.assign(block.rowEnds.begin(), block.rowEnds.end());
+                cut.columnEnds.assign(block.columnEnds.begin(), block.columnEnds.end());
+                cut.seam.assign(block.seam.begin(), block.seam.end());
+                cut.cleared.assign(block.cleared.begin(), block.cleared.end());
             }
-            else if (auto* select = std::get_if<WeightedBlockSelection>(&settings.blockSelection))
+            else
             {
-                if (settings.useGpuAcceleration)
+                // Graph cut capacities can't be negative, so the log cost only applies to boundary cuts
+                if (settings.useLogCost && settings.seamFinder == SeamFinder::BoundaryCut)
+                {
+                    for (auto& difference : differences)
+                    {
+                        for (auto& cost : difference)
+                        {
+                            if (cost > 0)
+                            {
+                                cost = std::log(cost);
+                            }
+                        }
+                    }
+                }
+
+                if (settings.seamFinder == SeamFinder::GraphCut)
                 {
-                    srcPos = selectBestBlockGpu(*select, rng, sourceTexture, quiltImage, blockSize, blockPos, overlap);
+                    findGraphCut(scratch.maxFlow, differences[0], differences[1], blockSize, overlap, kind, cut);
                 }
                 else
                 {
-                    srcPos = selectBestBlockCpu(*select, rng, sourceImage, quiltImage, blockSize, blockPos, overlap);
+                    findBlockCut(differences[0], differences[1], blockSize, overlap, kind, scratch.leftCosts, scratch.topCosts, cut);
                 }
             }
 
-            if (needSources)
+            if (record)
             {
-                blockSources.push_back(srcPos);
+                auto& block = record->blocks[blockId];
+                block.rowEnds = cut.rowEnds;
+                block.columnEnds = cut.columnEnds;
+                block.seam = cut.seam;
+                block.cleared = cut.cleared;
             }
 
-            sf::Image blockImage{ sf::Vector2u(blockSize) };
-            blockImage.copy(sourceImage, {}, { srcPos, blockSize });
-
-            const sf::Vector2i topOverlap(blockSize.x, overlap.y);
-            const sf::Vector2i leftOverlap(overlap.x, blockSize.y);
-
-            const auto handleOverlap = [&]<Direction direction>(auto overlap)
+            // Averages are taken before the block lands, a block that's copied straight in gets them written over it afterwards
+            if (seamBlending == SeamBlending::Average)
             {
-                std::vector<float> difference = imageDifference(quiltImage, blockImage, { blockPos, overlap });
-
-                if(settings.showDifference)
+                for (const auto pos : cut.seam)
                 {
-                    const auto maxDifference = *std::max_element(difference.begin(), difference.end());
-                    for (int x = 0; x < difference.size(); x++)
-                    {
-                        const auto diff = difference[x] / maxDifference;
-                        const auto color = sf::Color(255 * diff, 255 * diff, 255 * diff, 255);
-                        const auto pos = sf::Vector2u(x % overlap.x, x / overlap.x);
-                        blockImage.setPixel(pos, color);
-                    }
+                    const auto c1 = canvas.getPixel(Vector2u(pos + blockPos));
+                    const auto c2 = needBlockImage ? ImageRef(blockImage).getPixel(Vector2u(pos)) : sourceImage.getPixel(Vector2u(pos + srcPos));
+                    seamColors.push_back(lerpColor(c1, c2, 0.5f));
                 }
 
-                if (settings.useLogCost)
+                if (needBlockImage)
                 {
-                    for (auto& cost : difference)
+                    for (std::size_t i = 0; i < seamColors.size(); i++)
                     {
-                        if (cost > 0)
-                        {
-                            cost = std::log(cost);
-                        }
+                        setPixel(blockImage, Vector2u(cut.seam[i]), seamColors[i]);
                     }
                 }
+            }
 
-                auto path = generatePath<direction>(difference, overlap);
-
-                if (settings.blendSeams)
+            isCut = settings.doCut;
+            if (isCut && needBlockImage)
+            {
+                if (isFeathered)
                 {
-                    for (const auto pos : path)
-                    {
-                        const auto c1 = quiltImage.getPixel(sf::Vector2u(pos + blockPos));
-                        const auto c2 = blockImage.getPixel(sf::Vector2u(pos));
-                        blockImage.setPixel(sf::Vector2u(pos), lerpColor(c1, c2, 0.5f));
-                    }
+                    featherImage(blockImage, cut, overlap, kind, settings.featherWidth, scratch.feather);
+                }
+                else
+                {
+                    cutImage(blockImage, cut);
                 }
+            }
 
-                if (settings.doCut)
+            if (settings.showSeams)
+            {
+                for (const auto pos : cut.seam)
                 {
-                    cutImage<direction>(blockImage, path);
+                    const auto index = static_cast<std::size_t>(blockPos.x + pos.x) + static_cast<std::size_t>(blockPos.y + pos.y) * canvas.getSize().x;
+                    std::atomic_ref(seamMask[index / 64]).fetch_or(std::uint64_t(1) << (index % 64), std::memory_order_relaxed);
                 }
+            }
+        }
+
+        const auto quiltWidth = static_cast<int>(canvas.getSize().x);
+        if (needBlockImage)
+        {
+            canvas.copy(PixelView(ImageRef(blockImage)), Vector2u(blockPos), blockSize, true);
 
-                if (settings.showSeams)
+            if (!blockIds.empty())
+            {
+                const std::uint8_t* pixels = blockImage.getPixelsPtr();
+                for (int row = 0; row < blockSize.y; row++)
                 {
-                    for (auto pos : path)
+                    for (int column = 0; column < blockSize.x; column++)
                     {
-                        seamsImage.setPixel(sf::Vector2u(pos.x, pos.y) + sf::Vector2u(blockPos), sf::Color::Red);
+                        if (pixels[(column + row * blockSize.x) * 4 + 3] >= 128)
+                        {
+                            blockIds[blockPos.x + column + (blockPos.y + row) * quiltWidth] = blockId;
+                        }
                     }
                 }
+            }
+        }
+        else
+        {
+            const auto copyRun = [&](int row, int begin, int end)
+            {
+                canvas.copy(PixelView(sourceImage, srcPos + Vector2i(begin, row)), Vector2u(blockPos + Vector2i(begin, row)), { end - begin, 1 });
+                if (!blockIds.empty())
+                {
+                    std::fill_n(&blockIds[blockPos.x + begin + (blockPos.y + row) * quiltWidth], end - begin, blockId);
+                }
             };
 
-            if (blockPos.x > 0)
+            if (isCut)
+            {
+                forEachKeptRun(cut, blockSize, copyRun);
+            }
+            else
             {
-                handleOverlap.template operator()<Direction::Horizontal>(leftOverlap);
+                for (int row = 0; row < blockSize.y; row++)
+                {
+                    copyRun(row, 0, blockSize.x);
+                }
             }
 
-            if (blockPos.y > 0)
+            for (std::size_t i = 0; i < seamColors.size(); i++)
             {
-                handleOverlap.template operator()<Direction::Vertical>(topOverlap);
+                canvas.setPixel(Vector2u(cut.seam[i] + blockPos), seamColors[i]);
             }
+        }
+    };
 
-            quiltImage.copy(blockImage, sf::Vector2u(blockPos), {}, true);
+    // A block has to be placed after every earlier block (in raster order) whose footprint intersects its own.
+    // Those are at most `reach` blocks away horizontally, so the wavefront index x + (reach + 1) * y puts all of them
+    // on earlier wavefronts, while blocks sharing a wavefront never touch each other and can be placed concurrently.
+    const int reach = (blockSize.x - 1) / (blockSize.x - overlap.x);
+    const int skew = reach + 1;
+    const int wavefrontCount = (quiltSize.x - 1) + skew * (quiltSize.y - 1) + 1;
+
+    std::vector<Vector2i> wavefront;
+    wavefront.reserve(quiltSize.y);
+
+    for (int index = 0; index < wavefrontCount; index++)
+    {
+        wavefront.clear();
+        for (int y = 0; y < quiltSize.y; y++)
+        {
+            const int x = index - skew * y;
+            if (x >= 0 && x < quiltSize.x)
+            {
+                wavefront.emplace_back(x, y);
+            }
         }
+
+        threadPool.parallelFor(static_cast<int>(wavefront.size()), [&](int blockIndex)
+        {
+            std::unique_ptr<BlockScratch> scratch;
+            {
+                std::lock_guard lock(state->scratchesMutex);
+                if (!state->scratches.empty())
+                {
+                    scratch = std::move(state->scratches.back());
+                    state->scratches.pop_back();
+                }
+            }
+
+            if (!scratch)
+            {
+                scratch = std::make_unique<BlockScratch>();
+            }
+
+            placeBlock(wavefront[blockIndex].x, wavefront[blockIndex].y, *scratch);
+
+            std::lock_guard lock(state->scratchesMutex);
+            state->scratches.push_back(std::move(scratch));
+        });
+    }
+
+    if (!blockIds.empty())
+    {
+        blendSeamsPoisson(canvas, blockIds, threadPool);
     }
 
     if (settings.showSeams)
     {
-        quiltImage.copy(seamsImage, {}, {}, true);
+        const auto width = canvas.getSize().x;
+        for (std::size_t word = 0; word < seamMask.size(); word++)
+        {
+            for (auto bits = seamMask[word]; bits != 0; bits &= bits - 1)
+            {
+                const auto index = word * 64 + std::countr_zero(bits);
+                canvas.setPixel(Vector2u(static_cast<unsigned int>(index % width), static_cast<unsigned int>(index / width)), Color(255, 0, 0));
+            }
+        }
+    }
+
+    // The caller's pixels get the finished quilt straight away, tileable ones already cropped
+    if (isDirect)
+    {
+        return {};
+    }
+
+    if (output)
+    {
+        writeImage(quiltImage, settings.makeTileable ? Vector2u(blockSize / 2) : Vector2u(), *output);
+        return {};
     }
 
     if (settings.makeTileable)
     {
-        const auto temp = std::move(quiltImage);
-        const auto newQuiltDimension = sf::Vector2i(quiltImage.getSize()) - blockSize;
-        quiltImage.resize(sf::Vector2u(newQuiltDimension));
-        quiltImage.copy(temp, {}, { blockSize / 2, newQuiltDimension });
+        Image tileableImage(getQuiltSize(settings));
+        Canvas(tileableImage).copy(PixelView(ImageRef(quiltImage), blockSize / 2), {}, Vector2i(tileableImage.getSize()));
+        return tileableImage;
     }
 
     return quiltImage;
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <variant>
-
-#include <SFML/Graphics.hpp>
+#include <string>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <span>
+#include <cstdint>
+#include <cstddef>
 
 #if QUILTIS_SHARED_LIB
 #if _WIN32
@@ -22,6 +27,83 @@
 
 namespace Quiltis
 {
+    template<typename T>
+    struct Vector2
+    {
+        T x{};
+        T y{};
+
+        constexpr Vector2() = default;
+
+        constexpr Vector2(T x, T y) : x(x), y(y)
+        {
+        }
+
+        template<typename U>
+        constexpr explicit Vector2(Vector2<U> vector) : x(static_cast<T>(vector.x)), y(static_cast<T>(vector.y))
+        {
+        }
+
+        constexpr Vector2 componentWiseMul(Vector2 other) const
+        {
+            return { x * other.x, y * other.y };
+        }
+
+        constexpr Vector2 componentWiseDiv(Vector2 other) const
+        {
+            return { x / other.x, y / other.y };
+        }
+
+        constexpr Vector2 operator-() const
+        {
+            return { -x, -y };
+        }
+
+        constexpr Vector2& operator+=(Vector2 other)
+        {
+            x += other.x;
+            y += other.y;
+            return *this;
+        }
+
+        constexpr Vector2& operator-=(Vector2 other)
+        {
+            x -= other.x;
+            y -= other.y;
+            return *this;
+        }
+
+        friend constexpr Vector2 operator+(Vector2 a, Vector2 b)
+        {
+            return { a.x + b.x, a.y + b.y };
+        }
+
+        friend constexpr Vector2 operator-(Vector2 a, Vector2 b)
+        {
+            return { a.x - b.x, a.y - b.y };
+        }
+
+        friend constexpr Vector2 operator*(Vector2 a, T b)
+        {
+            return { a.x * b, a.y * b };
+        }
+
+        friend constexpr Vector2 operator*(T a, Vector2 b)
+        {
+            return { a * b.x, a * b.y };
+        }
+
+        friend constexpr Vector2 operator/(Vector2 a, T b)
+        {
+            return { a.x / b, a.y / b };
+        }
+
+        friend constexpr bool operator==(Vector2 a, Vector2 b) = default;
+    };
+
+    using Vector2i = Vector2<int>;
+    using Vector2u = Vector2<unsigned int>;
+
     struct RandomBlockSelection {};
 
     struct WeightedBlockSelection
@@ -30,28 +112,247 @@ namespace Quiltis
         float selectionSpan = 0.1f;
     };
 
-    using BlockSelection = std::variant<RandomBlockSelection, WeightedBlockSelection>;
+    struct FftBlockSelection
+    {
+        float selectionSpan = 0.1f;
+    };
+
+    struct IndexedBlockSelection
+    {
+        int candidateCount = 32;
+        int dimensions = 16;
+        int indexStride = 1;
+    };
+
+    struct PyramidBlockSelection
+    {
+        int levels = 2;
+        int survivorCount = 256;
+        float selectionSpan = 0.1f;
+    };
+
+    using BlockSelection = std::variant<RandomBlockSelection, WeightedBlockSelection, FftBlockSelection, IndexedBlockSelection, PyramidBlockSelection>;
+
+    enum class SeamFinder
+    {
+        // Row by row minimum error boundary cut, as in the quilting paper
+        BoundaryCut,
+        // Minimum cut over the overlap pixels, seams can take any shape
+        GraphCut
+    };
+
+    enum class SeamBlending
+    {
+        None,
+        // Averages the two sides on the seam pixels
+        Average,
+        // Solves for the smoothest correction that removes the jump across every seam in the finished quilt
+        Poisson,
+        // Cross fades the two sides over featherWidth pixels around the seam instead of cutting
+        Feather
+    };
 
     struct Settings
     {
         int seed{ 4830 };
 
-        sf::Vector2i blockSize{ 90, 90 };
-        sf::Vector2i overlap{ blockSize / 6};
-        sf::Vector2i quiltSize{ 4, 4 };
+        Vector2i blockSize{ 90, 90 };
+        Vector2i overlap{ blockSize / 6};
+        Vector2i quiltSize{ 4, 4 };
 
         bool doCut = true;
         bool showSeams = false;
         bool showDifference = false;
-        bool blendSeams = false;
         bool useLogCost = true;
         bool makeTileable = false;
 
+        SeamFinder seamFinder = SeamFinder::BoundaryCut;
+        SeamBlending seamBlending = SeamBlending::None;
+
+        // Deprecated, use seamBlending. Kept for code written before it: true averages the seams when seamBlending is left at None
+        bool blendSeams = false;
+
+        // Width of the Feather ramp in pixels, 0 cuts like the other modes
+        int featherWidth = 8;
+
+        // Needs an OpenGL context, builds made without QUILTIS_USE_GPU ignore it
         bool useGpuAcceleration = true;
 
+        // 0 uses every hardware thread
+        int threadCount = 0;
+
+        // Source analysis is saved there and reused by later runs, empty disables it
+        std::string cacheDirectory;
+
         BlockSelection blockSelection{ WeightedBlockSelection{} };
     };
 
+    // 8 bits per channel
+    enum class PixelFormat
+    {
+        Gray,
+        Rgb,
+        Rgba,
+        Bgra
+    };
+
+    // Pixels owned by the caller, rows start `stride` bytes apart. Rgba sources with rows packed together (a stride of
+    // width * 4) are read in place, others are converted into a copy first
+    struct ImageView
+    {
+        const std::uint8_t* data = nullptr;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        std::size_t stride = 0;
+        PixelFormat format = PixelFormat::Rgba;
+    };
+
+    // The same for pixels written by the library
+    struct MutableImageView
+    {
+        std::uint8_t* data = nullptr;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        std::size_t stride = 0;
+        PixelFormat format = PixelFormat::Rgba;
+    };
+
+    // RGBA pixels with rows packed together, how quilts are handed back
+    class Image
+    {
+    public:
+        Image() = default;
+
+        // Opaque black unless the pixels are given
+        explicit Image(Vector2u size, const std::uint8_t* pixels = nullptr) : size(size)
+        {
+            const auto byteCount = static_cast<std::size_t>(size.x) * size.y * 4;
+            if (pixels)
+            {
+                this->pixels.assign(pixels, pixels + byteCount);
+                return;
+            }
+
+            this->pixels.resize(byteCount);
+            for (std::size_t i = 3; i < byteCount; i += 4)
+            {
+                this->pixels[i] = 255;
+            }
+        }
+
+        Vector2u getSize() const
+        {
+            return size;
+        }
+
+        const std::uint8_t* getPixelsPtr() const
+        {
+            return pixels.data();
+        }
+
+        std::uint8_t* getPixelsPtr()
+        {
+            return pixels.data();
+        }
+
+        ImageView getView() const
+        {
+            return { pixels.data(), size.x, size.y, static_cast<std::size_t>(size.x) * 4, PixelFormat::Rgba };
+        }
+
+    private:
+        Vector2u size;
+        std::vector<std::uint8_t> pixels;
+    };
+
+    // Everything quilt() decides before drawing: where each block is taken from and how it's cut into the quilt.
+    // Rendering a plan with the settings it was made with gives the same quilt, other drawing settings redraw the same blocks
+    struct QuiltPlan
+    {
+        struct Block
+        {
+            Vector2i sourcePos;
+
+            // On row y the first rowEnds[y] pixels are cut away and on column x the first columnEnds[x], all empty for the first block
+            std::vector<int> rowEnds;
+            std::vector<int> columnEnds;
+            // Kept pixels next to the cut
+            std::vector<Vector2i> seam;
+            // Graph cuts mark every cut away pixel instead, row by row
+            std::vector<std::uint8_t> cleared;
+        };
 
-    QUILTIS_API sf::Image quilt(const sf::Image& sourceImage, const Settings& settings);
+        Vector2i blockSize;
+        Vector2i overlap;
+        Vector2i quiltSize;
+        bool makeTileable = false;
+
+        // In raster order
+        std::vector<Block> blocks;
+
+        // Compact and byte order independent
+        QUILTIS_API std::vector<std::uint8_t> serialize() const;
+        // Empty when the data isn't a plan
+        QUILTIS_API static std::optional<QuiltPlan> deserialize(std::span<const std::uint8_t> data);
+    };
+
+    // The free functions analyse the source for this one call, a Quilter keeps the analysis between calls
+    QUILTIS_API Image quilt(const ImageView& sourceImage, const Settings& settings);
+
+    // Size of the quilt the settings make
+    QUILTIS_API Vector2u getQuiltSize(const Settings& settings);
+
+    // quilt() into the caller's pixels, like a region of an atlas page, `quiltImage` has to be getQuiltSize() big.
+    // Rgba views are drawn into directly, other formats and tileable quilts go through an image first and colours become Gray by their luma.
+    // False when nothing was written
+    QUILTIS_API bool quilt(const ImageView& sourceImage, const Settings& settings, const MutableImageView& quiltImage);
+
+    // One quilt per seed, in the same order, made concurrently from a single analysis of the source
+    QUILTIS_API std::vector<Image> quiltBatch(const ImageView& sourceImage, const Settings& settings, std::span<const int> seeds);
+
+    // Picks and cuts the blocks like quilt(), a plan without blocks means the settings can't be used
+    QUILTIS_API QuiltPlan plan(const ImageView& sourceImage, const Settings& settings);
+
+    // Draws a plan made from the same source. Its blocks and their geometry come from the plan and only the drawing settings
+    // are used: doCut, seamBlending, featherWidth, showSeams, showDifference and threadCount. Empty when the plan doesn't fit the source
+    QUILTIS_API Image render(const QuiltPlan& plan, const ImageView& sourceImage, const Settings& settings);
+
+    // Quilts the same source any number of times. What's derived from the source, the threads and the buffers are kept
+    // between calls, so only the first one pays for setting them up. A source read in place has to outlive the Quilter.
+    // Calls on one Quilter must not overlap
+    class QUILTIS_API Quilter
+    {
+    public:
+        explicit Quilter(const ImageView& sourceImage);
+        ~Quilter();
+
+        Quilter(Quilter&&) noexcept;
+        Quilter& operator=(Quilter&&) noexcept;
+
+        Image quilt(const Settings& settings);
+        bool quilt(const Settings& settings, const MutableImageView& quiltImage);
+        std::vector<Image> quiltBatch(const Settings& settings, std::span<const int> seeds);
+        QuiltPlan plan(const Settings& settings);
+        Image render(const QuiltPlan& plan, const Settings& settings);
+
+    private:
+        struct State;
+
+        Quilter();
+
+        // Brings the source analysis, texture and thread pool in line with the settings before synthesizing with them
+        void prepare(const Settings& settings, bool isReplay);
+
+        // Either picks the blocks, saving them to `record` if given, or takes them from `replay`. Several can run at once after prepare().
+        // With an `output` the quilt is written there and the returned image is empty
+        Image synthesize(const Settings& settings, const QuiltPlan* replay, QuiltPlan* record, const MutableImageView* output);
+
+        friend QUILTIS_API Image Quiltis::quilt(const ImageView& sourceImage, const Settings& settings);
+        friend QUILTIS_API bool Quiltis::quilt(const ImageView& sourceImage, const Settings& settings, const MutableImageView& quiltImage);
+        friend QUILTIS_API std::vector<Image> Quiltis::quiltBatch(const ImageView& sourceImage, const Settings& settings, std::span<const int> seeds);
+        friend QUILTIS_API QuiltPlan Quiltis::plan(const ImageView& sourceImage, const Settings& settings);
+        friend QUILTIS_API Image Quiltis::render(const QuiltPlan& plan, const ImageView& sourceImage, const Settings& settings);
+
+        std::unique_ptr<State> state;
+    };
 };
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "quiltis.hpp"
+
+#include <SFML/Graphics/Image.hpp>
+
+// sf::Image versions of the Quiltis functions. The library itself doesn't use SFML, link Quiltis::SFML for these
+namespace Quiltis
+{
+    // An sf::Image keeps RGBA rows packed together, so it's read in place
+    inline ImageView toView(const sf::Image& image)
+    {
+        const auto size = image.getSize();
+        if (size.x == 0 || size.y == 0)
+        {
+            return {};
+        }
+
+        return { image.getPixelsPtr(), size.x, size.y, static_cast<std::size_t>(size.x) * 4, PixelFormat::Rgba };
+    }
+
+    inline sf::Image toSfImage(const Image& image)
+    {
+        const auto size = image.getSize();
+        if (size.x == 0 || size.y == 0)
+        {
+            return {};
+        }
+
+        return sf::Image({ size.x, size.y }, image.getPixelsPtr());
+    }
+
+    inline sf::Image quilt(const sf::Image& sourceImage, const Settings& settings)
+    {
+        return toSfImage(quilt(toView(sourceImage), settings));
+    }
+
+    inline bool quilt(const sf::Image& sourceImage, const Settings& settings, const MutableImageView& quiltImage)
+    {
+        return quilt(toView(sourceImage), settings, quiltImage);
+    }
+
+    inline std::vector<sf::Image> quiltBatch(const sf::Image& sourceImage, const Settings& settings, std::span<const int> seeds)
+    {
+        std::vector<sf::Image> images;
+        for (const auto& image : quiltBatch(toView(sourceImage), settings, seeds))
+        {
+            images.push_back(toSfImage(image));
+        }
+        return images;
+    }
+
+    inline QuiltPlan plan(const sf::Image& sourceImage, const Settings& settings)
+    {
+        return plan(toView(sourceImage), settings);
+    }
+
+    inline sf::Image render(const QuiltPlan& plan, const sf::Image& sourceImage, const Settings& settings)
+    {
+        return toSfImage(render(plan, toView(sourceImage), settings));
+    }
+}
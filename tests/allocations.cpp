@@ -0,0 +1,126 @@
+// Placing a block doesn't allocate once a Quilter has quilted a first time, so a quilt with more blocks
+// makes no more allocations than a smaller one
+
+#include "quiltis.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+namespace
+{
+    std::atomic<long> allocationCount{ 0 };
+
+    Quiltis::Image makeSource()
+    {
+        // Blurred noise, so that selection has something to tell blocks apart by
+        const Quiltis::Vector2u size{ 160, 120 };
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<int> channel(0, 255);
+
+        std::vector<int> noise(size.x * size.y * 3);
+        for (auto& value : noise)
+        {
+            value = channel(rng);
+        }
+
+        Quiltis::Image image(size);
+        std::uint8_t* pixel = image.getPixelsPtr();
+        for (unsigned int y = 0; y < size.y; y++)
+        {
+            for (unsigned int x = 0; x < size.x; x++, pixel += 4)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    const int sum = noise[(x + y * size.x) * 3 + c] + noise[((x + 1) % size.x + y * size.x) * 3 + c] + noise[(x + (y + 1) % size.y * size.x) * 3 + c];
+                    pixel[c] = static_cast<std::uint8_t>(sum / 3);
+                }
+            }
+        }
+        return image;
+    }
+
+    long countAllocations(Quiltis::Quilter& quilter, const Quiltis::Settings& settings)
+    {
+        const long before = allocationCount;
+        const auto image = quilter.quilt(settings);
+        const long count = allocationCount - before;
+        return image.getSize().x > 0 ? count : -1;
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    allocationCount++;
+    if (void* pointer = std::malloc(size ? size : 1))
+    {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+int main()
+{
+    const auto source = makeSource();
+
+    struct Case
+    {
+        const char* name;
+        Quiltis::SeamFinder seamFinder;
+        Quiltis::BlockSelection blockSelection;
+        Quiltis::SeamBlending seamBlending;
+    };
+
+    const Case cases[] = {
+        { "weighted, boundary cut", Quiltis::SeamFinder::BoundaryCut, Quiltis::WeightedBlockSelection{}, Quiltis::SeamBlending::None },
+        { "weighted, graph cut", Quiltis::SeamFinder::GraphCut, Quiltis::WeightedBlockSelection{}, Quiltis::SeamBlending::None },
+        { "fft, boundary cut", Quiltis::SeamFinder::BoundaryCut, Quiltis::FftBlockSelection{}, Quiltis::SeamBlending::None },
+        { "indexed, boundary cut", Quiltis::SeamFinder::BoundaryCut, Quiltis::IndexedBlockSelection{}, Quiltis::SeamBlending::None },
+        { "pyramid, boundary cut", Quiltis::SeamFinder::BoundaryCut, Quiltis::PyramidBlockSelection{}, Quiltis::SeamBlending::None },
+        { "weighted, boundary cut, feathered", Quiltis::SeamFinder::BoundaryCut, Quiltis::WeightedBlockSelection{}, Quiltis::SeamBlending::Feather },
+    };
+
+    int failures = 0;
+    for (const auto& testCase : cases)
+    {
+        Quiltis::Settings settings;
+        settings.useGpuAcceleration = false;
+        settings.threadCount = 1;
+        settings.blockSize = { 32, 32 };
+        settings.overlap = { 6, 6 };
+        settings.seamFinder = testCase.seamFinder;
+        settings.blockSelection = testCase.blockSelection;
+        settings.seamBlending = testCase.seamBlending;
+
+        Quiltis::Quilter quilter(source.getView());
+
+        // The first quilt sets up the source's analysis and the block scratch
+        settings.quiltSize = { 8, 8 };
+        quilter.quilt(settings);
+
+        settings.quiltSize = { 4, 4 };
+        const long smallCount = countAllocations(quilter, settings);
+        settings.quiltSize = { 8, 8 };
+        const long largeCount = countAllocations(quilter, settings);
+
+        const bool passed = smallCount >= 0 && largeCount >= 0 && largeCount <= smallCount;
+        std::printf("%s: %ld allocations for 16 blocks, %ld for 64 blocks%s\n", testCase.name, smallCount, largeCount, passed ? "" : ", FAILED");
+        failures += !passed;
+    }
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}